@@ -8,10 +8,28 @@
 #include <ESP8266WebServer.h>
 #include <ESP8266HTTPClient.h>
 #include <ESP8266mDNS.h>
+#include <lwip/tcp.h>
+#include <include/ClientContext.h>
 #include <ArduinoJson.h>
 #include <ArduinoOTA.h>
 #include "main.h"
 
+#define log_error 1
+#define log_warn 2
+#define log_info 3
+#define log_debug 4
+#define log_trace 5
+#ifndef log_max_level
+  #define log_max_level log_info
+#endif
+#define logging(level) ((level) <= log_max_level && (level) <= log_threshold)
+#define noteLevel(level, text) do { if (logging(level)) { note(text, level); } } while (0)
+#define noteError(text) noteLevel(log_error, text)
+#define noteWarn(text) noteLevel(log_warn, text)
+#define noteInfo(text) noteLevel(log_info, text)
+#define noteDebug(text) noteLevel(log_debug, text)
+#define noteTrace(text) noteLevel(log_trace, text)
+
 #ifdef physical_clock
   RTC_DS1307 rtc;
 #else
@@ -19,27 +37,104 @@
 #endif
 
 ESP8266WebServer server(80);
-WiFiClient wifiClient;
-HTTPClient httpClient;
 WiFiUDP wifiUdp;
 NTPClient ntpClient(wifiUdp);
+#ifdef telemetry
+  WiFiUDP telemetryUdp;
+#endif
 SunSet sun;
 
 const int core_version = 25;
 bool offline = true;
 bool keep_log = false;
 int last_accessed_log = 0;
-
-const char days_of_the_week[7][2] = {"s", "o", "u", "e", "h", "r", "a"};
+const uint8_t log_uptime_flag = 1;
+const uint8_t log_session_flag = 2;
+const int log_flash_size = 128;
+const int log_buffer_size = 1024;
+const int log_flush_threshold = 768;
+const int log_flush_delay = 10000;
+const int log_budget = 32768;
+const int log_segment_size = 8192;
+const int log_segments = log_budget / log_segment_size;
+char log_buffer[log_buffer_size];
+int log_buffer_length = 0;
+int log_segment = 0;
+char log_time[26]; // Fits "[255.255.99 255:255:255] ", the widest the uint8_t fields of DateTime format to.
+uint32_t log_time_u_time = 0;
+uint8_t log_time_flags = 0xFF;
+uint32_t log_buffer_millis = 0;
+uint8_t log_threshold = log_info;
+
+constexpr char days_of_the_week[] = "souehra"; // Indexed by DateTime::dayOfTheWeek(), a smart day mask uses the same bits.
+constexpr uint8_t every_day = 0x7F;
 char host_name[30] = {0};
 
 struct Device {
   String ip;
   String mac;
+  String service; // mDNS service instance that announced the peer, used to withdraw it.
+  uint32_t seen_millis;
+  uint32_t failed_millis;
+  bool multicast; // Announced "multicast":true, so it gets broadcasts from telemetry instead of HTTP.
+  uint32_t multicast_seq;
+};
+
+struct Dispatch {
+  String ip;
+  String data;
+  bool log;
+  bool query; // POST /basicdata and read the reply instead of PUT /set.
 };
 
-Device *devices_array;
+struct Transfer { // A dispatch in flight, polled by the loop until the peer closes or transfer_timeout passes.
+  Dispatch dispatch;
+  tcp_pcb* pcb; // The connect in progress, handed over to client once established.
+  WiFiClient client;
+  String response;
+  uint32_t sent_millis;
+  bool connecting;
+  bool busy;
+};
+
+struct TransferClient : public WiFiClient { // WiFiClient::connect() waits for the handshake, this adopts a pcb that has already completed it.
+  TransferClient(tcp_pcb* pcb) : WiFiClient(new ClientContext(pcb, nullptr, nullptr)) {}
+};
+
+struct LogRecord { // Layout of a log segment entry, followed by length bytes of text.
+  uint32_t u_time;
+  uint16_t length;
+  uint8_t flags;
+  uint8_t level;
+};
+
+const int max_devices = 16;
+const uint32_t device_ttl = 900000;
+const uint32_t device_query_interval = 60000;
+Device devices_array[max_devices];
 int devices_count = 0;
+bool devices_queried = false;
+uint32_t devices_query_millis = 0;
+MDNSResponder::hMDNSServiceQuery devices_query = 0;
+const uint32_t device_backoff = 30000;
+const int max_dispatches = max_devices;
+Dispatch dispatch_array[max_dispatches];
+int dispatch_first = 0;
+int dispatch_count = 0;
+uint32_t dispatch_drops = 0;
+const int max_transfers = 4;
+const uint16_t transfer_connect_timeout = 250;
+const uint16_t transfer_timeout = 1500;
+const int transfer_response_size = 1024;
+Transfer transfers_array[max_transfers];
+#ifdef telemetry
+  const IPAddress telemetry_group(239, 255, 73, 1);
+  const uint16_t telemetry_port = 8081;
+  const int telemetry_size = 512;
+  uint32_t telemetry_seq = 0;
+  uint32_t telemetry_lost = 0;
+  const char* const telemetry_keys[] = {"temp"}; // All a datagram may pass on to readData(), settings still need /set.
+#endif
 
 String ssid = "";
 String password = "";
@@ -47,39 +142,69 @@ bool auto_reconnect = false;
 
 uint32_t start_u_time = 0;
 uint32_t loop_u_time = 0;
+uint32_t rtc_u_time = 0;
+uint32_t rtc_millis = 0; // Estimated start of the second rtc_u_time, RTCnow() counts on from it with millis().
+const uint32_t rtc_refresh = 60000;
+uint32_t rtc_read_millis = 0;
+bool rtc_running = false;
+bool rtc_read = false;
+uint32_t i2c_transactions = 0;
+uint32_t file_sequence = 0;
 int uprisings = 1;
 int offset = 0;
 bool dst = false;
 
+enum SmartAction : uint8_t {
+  no_action,
+  value_action,
+  decimal_action,
+  remote_action,
+  off_action,
+  on_action
+};
+
+const int16_t no_setpoint = -32768;
+
+const uint8_t rising_armed = 1;
+const uint8_t falling_armed = 2;
+const uint8_t crossing_unknown = 4; // No sample has been seen since the rule was set.
+
+enum SmartCondition : uint8_t {
+  no_condition,
+  equal_condition,
+  less_condition,
+  greater_condition
+};
+
+enum SmartTarget : uint8_t {
+  state_target,
+  temperature_target
+};
+
+struct SmartPredicate {
+  SmartCondition condition;
+  SmartTarget target;
+  int16_t operand; // Hundredths of a degree for temperature_target.
+};
+
+enum SmartTwilight : uint8_t {
+  after_sunset = 1,
+  after_sunrise = 2,
+  after_dusk = 4,
+  after_dawn = 8
+};
+
+constexpr char twilight_letters[] = "nd<>"; // SmartTwilight bits in r2().
+
 struct Smart {
   String smart_string;
-  bool enabled;
-  String days;
   #if defined(light_switch) || defined(blinds)
     String what;
   #endif
-  bool any_trigger_required;
-  String action;
-  int at_time;
-  int start_time;
-  int end_time;
-  bool at_sunset;
-  int sunset_offset;
-  bool has_lowering_at_sunset_offset;
-  bool at_sunrise;
-  int sunrise_offset;
-  int at_dusk;
-  int local_dusk_time;
-  int dusk_offset;
-  int dusk_day;
-  int at_dawn;
-  int local_dawn_time;
-  int dawn_offset;
-  int dawn_day;
   #ifdef light_switch
-  String at_switch;
-  int switch_offset;
-  int switch_offset_countdown;
+    String at_switch;
+    int switch_offset;
+    int switch_offset_countdown;
   #endif
   #ifdef blinds
     String at_blinds;
@@ -87,24 +212,72 @@ struct Smart {
     int blinds_offset_countdown;
   #endif
   #ifdef thermostat
-    String at_thermostat;
-    int thermostat_offset;
     int thermostat_offset_countdown;
+    int16_t at_thermostat; // Hundredths of a degree.
+    int16_t thermostat_offset;
+    int8_t thermostat_direction; // 1 rising, -1 falling, 0 both ways.
+    uint8_t thermostat_armed; // Crossings allowed by the hysteresis band.
   #endif
   #ifdef chain
     String at_chain;
     int chain_offset;
     int chain_offset_countdown;
   #endif
-  String must_be_; // This is a fulfillment condition, not a trigger.
-  String twilight_must_be_;
+  #ifdef thermostat
+    SmartPredicate must_be; // This is a fulfillment condition, not a trigger.
+  #else
+    String must_be_; // This is a fulfillment condition, not a trigger.
+  #endif
   uint32_t lead_u_time;
+  int16_t at_time;
+  int16_t start_time;
+  int16_t end_time;
+  int16_t sunset_offset;
+  int16_t sunrise_offset;
+  int16_t at_dusk;
+  int16_t local_dusk_time;
+  int16_t dusk_offset;
+  int16_t at_dawn;
+  int16_t local_dawn_time;
+  int16_t dawn_offset;
+  int8_t dusk_day;
+  int8_t dawn_day;
+  uint8_t days;
+  uint8_t twilight_must_be; // SmartTwilight flags.
+  int16_t action_value; // Hundredths for decimal_action.
+  uint8_t action_start; // The action text stays in smart_string.
+  uint8_t action_length;
+  int16_t lead_start; // Position of e(), always after the action, or -1.
+  int16_t syntax_error; // Position of the error in a rule kept disabled and verbatim, or -1.
+  SmartAction action;
+  bool enabled;
+  bool any_trigger_required;
+  bool at_sunset;
+  bool has_lowering_at_sunset_offset;
+  bool at_sunrise;
+  bool state_changed; // Runtime state not yet in the journal.
+  uint32_t hash; // Rule text without the e() lead time, keys the persisted runtime state.
 };
 
 Smart *smart_array;
 int smart_count = 0;
 bool smart_lock = false;
 
+struct SmartTrigger {
+  int16_t minute;
+  int16_t index;
+};
+
+SmartTrigger *smart_trigger_array; // Rules that can only fire in a given minute, sorted by minute and index.
+int smart_trigger_count = 0;
+int16_t *smart_event_array; // Rules evaluated on every tick, sorted by index.
+int smart_event_count = 0;
+int16_t *smart_hash_array; // All rules, sorted by hash.
+
+const int smart_state_size = 384;
+const int smart_detail_size = 400;
+const int journal_limit = 4096; // The journal is folded into /smart.txt once it grows past this size.
+
 const String default_location = "52.2337172x21.0714322";
 String geo_location = default_location;
 int last_sun_check = -1;
@@ -124,28 +297,81 @@ bool strContains(int text, int value);
 String isStringDigit(String text, String fallback);
 bool isStringDigit(String text);
 String corectDateTime(int digit);
+int16_t toFixedPoint(float value);
+float fromFixedPoint(int16_t value);
+String fixedPointToString(int16_t value);
+void readRTC();
 bool RTCisrunning();
+DateTime RTCnow();
+void adjustRTC(const DateTime& date_time);
 bool hasTimeChanged();
-void note(String text);
+void note(const String& text, uint8_t level = log_info);
+void note(const __FlashStringHelper* text, uint8_t level = log_info);
+void note(const char* text, uint8_t level = log_info);
+const char* getLogTime(const LogRecord& record);
+void bufferLog(LogRecord record, const char* text, size_t length);
+void flushLog(bool force);
+String getLogSegment(int segment);
+int oldestLogSegment();
+void rotateLog();
+void removeLog();
+void setupLog();
 bool writeObjectToFile(String name, DynamicJsonDocument object);
+uint32_t getCRC32(const uint8_t* data, size_t length);
+bool writeCheckedFile(String path, const uint8_t* content, size_t length);
+uint8_t* readCheckedCopy(String path, size_t& length, uint32_t& sequence);
+uint8_t* readCheckedFile(String path, size_t& length);
+String readCheckedFile(String path);
 String get1(String text, int index, char separator);
 String oldSmart2NewSmart(const String& smart_string);
 String getSmartString(bool raw);
+String getSmartDays(uint8_t days);
+String getSmartMustBe(int index);
+String getSmartTwilightMustBe(int index);
+String getSmartAction(int index);
 void setSmart(const String& smart_string);
-DynamicJsonDocument getSmartJson(bool raw);
+void setSmartIndex();
+bool hasSmartState(int index);
+int findSmartHash(uint32_t hash);
+uint32_t hashSmart(const String& smart_string);
+bool migrateSmartFile();
+void journalSmart();
+void compactSmartJournal();
+int nextDueSmart(int& event, int& trigger, int current_time);
+bool getSmartJson(int index, bool raw, DynamicJsonDocument& json_object);
+void sendSmartJson(bool raw);
+void setSmartLeadTime(int index, uint32_t lead_u_time);
 void smartAction(int trigger, bool twilight_change);
 void connectingToWifi(bool use_wps);
 void initiatingWPS();
 void activationTheLog();
 void deactivationTheLog();
 void requestForLogs();
+void requestForLogTail();
+void sendLog(uint32_t from, uint32_t since);
+void sendLogSegment(File& file, uint32_t since, uint8_t* block, String& chunk);
+uint32_t getLogSegmentTime(int segment);
 void clearTheLog();
 void getSunriseSunset(DateTime now);
 int findMDNSDevices();
+void receivedMDNSDevice(MDNSResponder::MDNSServiceInfo service_info, MDNSResponder::AnswerType answer_type, bool set_content);
+int findDevice(const String& ip);
+int registerDevice(const String& ip, const String& mac);
+void removeDevice(int index);
+int getDevices();
 void receivedOfflineData();
 void putOfflineData(String url, String data);
 void putMultiOfflineData(String data);
 void putMultiOfflineData(String data, bool log);
+void queueOfflineData(const String& ip, const String& data, bool log, bool query);
+void dispatchOfflineData();
+void startTransfer(Transfer& transfer, const Dispatch& dispatch);
+void pollTransfer(Transfer& transfer);
+void finishTransfer(Transfer& transfer, int http_code);
+void transferError(void* arg, err_t error);
+void setupTelemetry();
+void sendTelemetry(const String& data);
+void receiveTelemetry();
 void getOfflineData();
 void setupOTA();
 void getSmartDetail();
@@ -189,16 +415,69 @@ String corectDateTime(int digit) {
   return String(digit);
 }
 
-bool RTCisrunning() {
+int16_t toFixedPoint(float value) {
+  return value < 0 ? value * 100 - 0.5 : value * 100 + 0.5;
+}
+
+float fromFixedPoint(int16_t value) {
+  return value / 100.0;
+}
+
+String fixedPointToString(int16_t value) { // Written the way rules spell it, 21.5 rather than 21.50.
+  String result = String(fromFixedPoint(value));
+  if (result.endsWith("0")) {
+    result.remove(result.length() - 1);
+  }
+  return result;
+}
+
+void readRTC() {
+  uint32_t u_time = 0;
   #ifdef physical_clock
-    return rtc.isrunning();
+    i2c_transactions++;
+    rtc_running = rtc.isrunning();
+    if (rtc_running) {
+      i2c_transactions++;
+      u_time = rtc.now().unixtime();
+    }
   #else
-    return rtc.now().unixtime() > 1546304461;
+    u_time = rtc.now().unixtime();
+    rtc_running = u_time > 1546304461;
+  #endif
+
+  uint32_t read_millis = millis();
+  if (!rtc_read || u_time != rtc_u_time + (read_millis - rtc_millis) / 1000) { // The count from millis() has drifted from the clock, start it again from this read.
+    rtc_u_time = u_time;
+    rtc_millis = read_millis;
+  }
+  rtc_read = true;
+  rtc_read_millis = read_millis;
+}
+
+bool RTCisrunning() {
+  if (!rtc_read || millis() - rtc_read_millis >= rtc_refresh) {
+    readRTC();
+  }
+  return rtc_running;
+}
+
+DateTime RTCnow() {
+  if (!rtc_read || millis() - rtc_read_millis >= rtc_refresh) {
+    readRTC();
+  }
+  return DateTime(rtc_u_time + (millis() - rtc_millis) / 1000);
+}
+
+void adjustRTC(const DateTime& date_time) {
+  #ifdef physical_clock
+    i2c_transactions++;
   #endif
+  rtc.adjust(date_time);
+  rtc_read = false;
 }
 
 bool hasTimeChanged() {
-  int current_u_time = RTCisrunning() ? rtc.now().unixtime() : millis() / 1000;
+  int current_u_time = RTCisrunning() ? RTCnow().unixtime() : millis() / 1000;
   if (abs(current_u_time - (int)loop_u_time) >= 1) {
     loop_u_time = current_u_time;
     return true;
@@ -206,35 +485,154 @@ bool hasTimeChanged() {
   return false;
 }
 
-void note(String text) {
-  String log_text = strContains(text, "iDom") ? "\n[" : "[";
+void note(const String& text, uint8_t level) {
+  note(text.c_str(), level);
+}
+
+void note(const __FlashStringHelper* text, uint8_t level) {
+  size_t length = strlen_P((PGM_P)text);
+  char text_buffer[log_flash_size];
+  char* copy = length < sizeof(text_buffer) ? text_buffer : new char[length + 1];
+  memcpy_P(copy, (PGM_P)text, length + 1);
+  note(copy, level);
+  if (copy != text_buffer) {
+    delete [] copy;
+  }
+}
+
+void note(const char* text, uint8_t level) {
+  if (level > log_threshold) {
+    return;
+  }
+
+  LogRecord record = {};
+  record.level = level;
+  record.flags = strncmp(text, "iDom", 4) == 0 ? log_session_flag : 0;
   if (RTCisrunning()) {
-    DateTime now = rtc.now();
-    log_text += now.day();
-    log_text += ".";
-    log_text += now.month();
-    log_text += ".";
-    log_text += String(now.year()).substring(2, 4);
-    log_text += " ";
-    log_text += now.hour();
-    log_text += ":";
-    log_text += now.minute();
-    if (now.second() > 0) {
-      log_text += ":";
-      log_text += now.second();
-    }
+    record.u_time = RTCnow().unixtime();
   } else {
-    log_text += millis() / 1000;
+    record.u_time = millis() / 1000;
+    record.flags |= log_uptime_flag;
   }
-  log_text += "] " + text;
 
-  Serial.print("\n" + log_text);
+  Serial.print(record.flags & log_session_flag ? "\n\n" : "\n");
+  Serial.print(getLogTime(record));
+  Serial.print(text);
 
   if (keep_log) {
-    File file = LittleFS.open("/log.txt", "a");
-    if (file) {
-      file.println(log_text);
-      file.close();
+    bufferLog(record, text, strlen(text));
+  }
+}
+
+const char* getLogTime(const LogRecord& record) {
+  uint8_t flags = record.flags & log_uptime_flag;
+  if (record.u_time == log_time_u_time && flags == log_time_flags) {
+    return log_time;
+  }
+
+  if (flags) {
+    snprintf(log_time, sizeof(log_time), "[%lu] ", (unsigned long)record.u_time);
+  } else {
+    DateTime time = DateTime(record.u_time);
+    if (time.second() > 0) {
+      snprintf(log_time, sizeof(log_time), "[%u.%u.%02u %u:%u:%u] ", time.day(), time.month(), time.year() % 100, time.hour(), time.minute(), time.second());
+    } else {
+      snprintf(log_time, sizeof(log_time), "[%u.%u.%02u %u:%u] ", time.day(), time.month(), time.year() % 100, time.hour(), time.minute());
+    }
+  }
+  log_time_u_time = record.u_time;
+  log_time_flags = flags;
+
+  return log_time;
+}
+
+void bufferLog(LogRecord record, const char* text, size_t length) {
+  record.length = min(length, log_buffer_size - sizeof(LogRecord));
+  if (log_buffer_length + sizeof(LogRecord) + record.length > log_buffer_size) {
+    flushLog(true);
+  }
+
+  if (log_buffer_length == 0) {
+    log_buffer_millis = millis();
+  }
+  memcpy(log_buffer + log_buffer_length, &record, sizeof(LogRecord));
+  memcpy(log_buffer + log_buffer_length + sizeof(LogRecord), text, record.length);
+  log_buffer_length += sizeof(LogRecord) + record.length;
+
+  if (log_buffer_length >= log_flush_threshold) {
+    flushLog(true);
+  }
+}
+
+void flushLog(bool force) {
+  if (log_buffer_length == 0 || (!force && millis() - log_buffer_millis < log_flush_delay)) {
+    return;
+  }
+
+  File file = LittleFS.open(getLogSegment(log_segment), "a");
+  if (file) {
+    file.write((const uint8_t*)log_buffer, log_buffer_length);
+    bool rotation = file.size() >= log_segment_size;
+    file.close();
+
+    if (rotation) {
+      rotateLog();
+    }
+  }
+  log_buffer_length = 0;
+}
+
+String getLogSegment(int segment) {
+  return "/log" + String(segment) + ".bin";
+}
+
+int oldestLogSegment() {
+  int segment = max(log_segment - log_segments + 1, 0);
+  while (segment < log_segment && !LittleFS.exists(getLogSegment(segment))) {
+    segment++;
+  }
+  return segment;
+}
+
+void rotateLog() {
+  log_segment++;
+  if (log_segment >= log_segments) {
+    LittleFS.remove(getLogSegment(log_segment - log_segments));
+  }
+  File file = LittleFS.open(getLogSegment(log_segment), "w"); // /log and Log-Offset need the newest segment even while it is empty.
+  file.close();
+
+  FSInfo fs_info;
+  int segment = oldestLogSegment();
+  while (segment < log_segment && LittleFS.info(fs_info) && fs_info.totalBytes - fs_info.usedBytes < 2 * log_segment_size) {
+    LittleFS.remove(getLogSegment(segment++));
+  }
+}
+
+void removeLog() {
+  for (int i = oldestLogSegment(); i <= log_segment; i++) {
+    LittleFS.remove(getLogSegment(i));
+  }
+  log_segment = 0;
+  log_buffer_length = 0;
+}
+
+void setupLog() {
+  if (LittleFS.exists("/log.txt")) {
+    LittleFS.remove("/log.txt");
+    keep_log = true;
+  }
+  if (LittleFS.exists("/log.bin")) {
+    LittleFS.rename("/log.bin", getLogSegment(0));
+  }
+
+  String name;
+  Dir dir = LittleFS.openDir("/");
+  while (dir.next()) {
+    name = dir.fileName();
+    if (name.startsWith("log") && name.endsWith(".bin")) {
+      log_segment = max(log_segment, (int)name.substring(3).toInt());
+      keep_log = true;
     }
   }
 }
@@ -252,6 +650,129 @@ bool writeObjectToFile(String name, DynamicJsonDocument object) {
   return result;
 }
 
+uint32_t getCRC32(const uint8_t* data, size_t length) {
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < length; i++) {
+    crc ^= data[i];
+    for (int j = 0; j < 8; j++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+bool writeCheckedFile(String path, const uint8_t* content, size_t length) { // Header: #sequence crc32 length
+  File file = LittleFS.open(path + ".tmp", "w");
+  if (!file) {
+    return false;
+  }
+
+  String header = "#" + String(++file_sequence) + " " + String(getCRC32(content, length), HEX) + " " + String(length) + "\n";
+  bool result = file.print(header) == header.length() && file.write(content, length) == length;
+  file.flush();
+  file.close();
+
+  size_t written_length;
+  uint32_t sequence;
+  uint8_t* written = result ? readCheckedCopy(path + ".tmp", written_length, sequence) : 0;
+  result = written != 0 && written_length == length && memcmp(written, content, length) == 0;
+  delete [] written;
+  if (!result) {
+    LittleFS.remove(path + ".tmp");
+    return false;
+  }
+
+  uint8_t* previous = LittleFS.exists(path) ? readCheckedCopy(path, written_length, sequence) : 0;
+  if (previous != 0) {
+    LittleFS.remove(path + ".bak");
+    LittleFS.rename(path, path + ".bak");
+  } else {
+    LittleFS.remove(path);
+  }
+  delete [] previous;
+
+  return LittleFS.rename(path + ".tmp", path);
+}
+
+uint8_t* readCheckedCopy(String path, size_t& length, uint32_t& sequence) { // The caller deletes the returned buffer.
+  File file = LittleFS.open(path, "r");
+  if (!file) {
+    return 0;
+  }
+
+  bool checked = file.peek() == '#';
+  uint32_t crc = 0;
+  sequence = 0;
+  length = file.size();
+  if (checked) {
+    String header = file.readStringUntil('\n');
+    char* end;
+    sequence = strtoul(header.c_str() + 1, &end, 10);
+    crc = strtoul(end, &end, 16);
+    length = strtoul(end, &end, 10);
+  }
+
+  uint8_t* content = 0;
+  if (length <= file.size()) {
+    content = new uint8_t[length + 1];
+    if (file.read(content, length) == (int)length) {
+      content[length] = 0;
+    } else {
+      delete [] content;
+      content = 0;
+    }
+  }
+  file.close();
+
+  if (content == 0 || (checked && getCRC32(content, length) != crc)) {
+    noteWarn("The " + path + " file is damaged");
+    delete [] content;
+    return 0;
+  }
+
+  return content;
+}
+
+uint8_t* readCheckedFile(String path, size_t& length) { // The valid copy with the highest sequence. The caller deletes the returned buffer.
+  const char* suffixes[] = {"", ".tmp", ".bak"};
+  uint8_t* content = 0;
+  uint32_t newest = 0;
+  for (const char* suffix : suffixes) {
+    if (!LittleFS.exists(path + suffix)) {
+      continue;
+    }
+
+    size_t copy_length;
+    uint32_t sequence;
+    uint8_t* copy = readCheckedCopy(path + suffix, copy_length, sequence);
+    if (copy != 0 && (suffix[0] == 0 || sequence > 0) && (content == 0 || sequence > newest)) {
+      delete [] content;
+      content = copy;
+      length = copy_length;
+      newest = sequence;
+    } else {
+      delete [] copy;
+    }
+  }
+
+  if (newest > file_sequence) {
+    file_sequence = newest;
+  }
+  return content;
+}
+
+String readCheckedFile(String path) {
+  size_t length;
+  uint8_t* content = readCheckedFile(path, length);
+  if (content == 0) {
+    return "";
+  }
+
+  String result = (const char*)content;
+  delete [] content;
+  return result;
+}
+
 String get1(String text, int index, char separator) {
   int found = 0;
   int str_index[] = {0, -1};
@@ -339,13 +860,13 @@ String oldSmart2NewSmart(const String& smart_string) {
       }
 
       if (!strContains(single_smart_string, "w")) {
-        result += strContains(single_smart_string, "o") ? "o" : "";
-        result += strContains(single_smart_string, "u") ? "u" : "";
-        result += strContains(single_smart_string, "e") ? "e" : "";
-        result += strContains(single_smart_string, "h") ? "h" : "";
-        result += strContains(single_smart_string, "r") ? "r" : "";
-        result += strContains(single_smart_string, "a") ? "a" : "";
-        result += strContains(single_smart_string, "s") ? "s" : "";
+        uint8_t days = 0;
+        for (int j = 0; j < 7; j++) {
+          if (single_smart_string.indexOf(days_of_the_week[j]) > -1) {
+            days |= 1 << j;
+          }
+        }
+        result += getSmartDays(days);
       }
 
       #if defined(light_switch) || defined(blinds)
@@ -422,300 +943,993 @@ String getSmartString(bool raw) {
   return result;
 }
 
-DynamicJsonDocument getSmartJson(bool raw) {
-  DynamicJsonDocument json_object(smart_count * 400);
-  int i = -1;
-  bool local_result;
-  int count = -1;
+String getSmartDays(uint8_t days) {
+  String result = "";
+  for (int i = 1; i <= 7; i++) {
+    if (days & (1 << (i % 7))) {
+      result += days_of_the_week[i % 7];
+    }
+  }
+  return result;
+}
 
-  while (++i < smart_count) {
-    local_result = (smart_array[i].at_sunset && smart_array[i].has_lowering_at_sunset_offset) || smart_array[i].lead_u_time > 0
-    || (smart_array[i].at_dusk > -1 && (smart_array[i].local_dusk_time > 0 || smart_array[i].dusk_day > -1))
-    || (smart_array[i].at_dawn > -1 && (smart_array[i].local_dawn_time > 0 || smart_array[i].dawn_day > -1));
-    #ifdef light_switch
-      local_result |= smart_array[i].at_switch != "?" && smart_array[i].switch_offset_countdown > 0;
-    #endif
-    #ifdef blinds
-    local_result |= smart_array[i].at_blinds != "?" && smart_array[i].blinds_offset_countdown > 0;
-    #endif
-    #ifdef thermostat
-      local_result |= smart_array[i].at_thermostat != "?" && smart_array[i].thermostat_offset_countdown > 0;
-    #endif
-    #ifdef chain
-      local_result |= smart_array[i].at_chain != "?" && smart_array[i].chain_offset_countdown > 0;
-    #endif
-    if (!raw || local_result) {
-      count++;
-      json_object[String(count)]["smart"] = smart_array[i].smart_string;
+String getSmartMustBe(int index) {
+  #ifdef thermostat
+    SmartPredicate must_be = smart_array[index].must_be;
+    if (must_be.condition == no_condition) {
+      return "?";
     }
-    if (!raw) {
-      if (!smart_array[i].enabled) {
-        json_object[String(count)]["enabled"] = false;
-      }
-      if (smart_array[i].days != "ouehras") {
-        json_object[String(count)]["days"] = smart_array[i].days;
+    if (must_be.target == state_target) {
+      return String(must_be.operand);
+    }
+    return (must_be.condition == less_condition ? "<" : (must_be.condition == greater_condition ? ">" : "")) + fixedPointToString(must_be.operand);
+  #else
+    return smart_array[index].must_be_;
+  #endif
+}
+
+String getSmartTwilightMustBe(int index) {
+  String result = "";
+  for (int i = 0; i < 4; i++) {
+    if (smart_array[index].twilight_must_be & (1 << i)) {
+      result += twilight_letters[i];
+    }
+  }
+  return result.length() > 0 ? result : "?";
+}
+
+String getSmartAction(int index) {
+  if (smart_array[index].action == no_action) {
+    return "?";
+  }
+  return smart_array[index].smart_string.substring(smart_array[index].action_start, smart_array[index].action_start + smart_array[index].action_length);
+}
+
+bool getSmartJson(int index, bool raw, DynamicJsonDocument& json_object) {
+  json_object.clear();
+  if (raw && !hasSmartState(index)) {
+    return false;
+  }
+
+  json_object["smart"] = smart_array[index].smart_string;
+  if (!raw) {
+    if (!smart_array[index].enabled) {
+      json_object["enabled"] = false;
+    }
+    if (smart_array[index].syntax_error > -1) {
+      json_object["syntax_error"] = smart_array[index].syntax_error;
+    }
+    if (smart_array[index].days != every_day) {
+      json_object["days"] = getSmartDays(smart_array[index].days);
+    }
+    #if defined(light_switch) || defined(blinds)
+      if (smart_array[index].what != "?") {
+        json_object["what"] = smart_array[index].what.toInt();
       }
-      #if defined(light_switch) || defined(blinds)
-        if (smart_array[i].what != "?") {
-          json_object[String(count)]["what"] = smart_array[i].what.toInt();
-        }
-      #endif
-      if (smart_array[i].action != "?") {
-        if (strContains(smart_array[i].action, ";") && !strContains(smart_array[i].action, ".")) {
-          for (int j = 0; j < 3; j++) {
-            json_object[String(count)]["action"][j] = get1(smart_array[i].action, j, ';').toInt();
-          }
-        } else {
-          json_object[String(count)]["action"] = smart_array[i].action;
+    #endif
+    if (smart_array[index].action != no_action) {
+      String action = getSmartAction(index);
+      if (strContains(action, ";") && !strContains(action, ".")) {
+        for (int j = 0; j < 3; j++) {
+          json_object["action"][j] = get1(action, j, ';').toInt();
         }
-      }
-      if (smart_array[i].any_trigger_required) {
-        json_object[String(count)]["any_trigger_required"] = true;
-      }
-      if (smart_array[i].at_time > -1) {
-        json_object[String(count)]["at_time"] = String(smart_array[i].at_time / 60) + ":" + (smart_array[i].at_time % 60 < 10 ? "0" + String(smart_array[i].at_time % 60) : String(smart_array[i].at_time % 60));
-      }
-      if (smart_array[i].start_time > -1 && smart_array[i].end_time > -1) {
-          json_object[String(count)]["between_hours"][0] = String(smart_array[i].start_time / 60) + ":" + (smart_array[i].start_time % 60 < 10 ? "0" + String(smart_array[i].start_time % 60) : String(smart_array[i].start_time % 60));
-          json_object[String(count)]["between_hours"][1] = String(smart_array[i].end_time / 60) + ":" + (smart_array[i].end_time % 60 < 10 ? "0" + String(smart_array[i].end_time % 60) : String(smart_array[i].end_time % 60));
       } else {
-        if (smart_array[i].start_time > -1) {
-          json_object[String(count)]["start_time"] = String(smart_array[i].start_time / 60) + ":" + (smart_array[i].start_time % 60 < 10 ? "0" + String(smart_array[i].start_time % 60) : String(smart_array[i].start_time % 60));
-        }
-        if (smart_array[i].end_time > -1) {
-          json_object[String(count)]["end_time"] = String(smart_array[i].end_time / 60) + ":" + (smart_array[i].end_time % 60 < 10 ? "0" + String(smart_array[i].end_time % 60) : String(smart_array[i].end_time % 60));
-        }
+        json_object["action"] = action;
       }
     }
-    if (smart_array[i].at_sunset) {
-      if (!raw) {
-        json_object[String(count)]["at_sunset"] = true;
-        if (smart_array[i].sunset_offset != 0) {
-          json_object[String(count)]["sunset_offset"] = smart_array[i].sunset_offset;
-        }
+    if (smart_array[index].any_trigger_required) {
+      json_object["any_trigger_required"] = true;
+    }
+    if (smart_array[index].at_time > -1) {
+      json_object["at_time"] = String(smart_array[index].at_time / 60) + ":" + (smart_array[index].at_time % 60 < 10 ? "0" + String(smart_array[index].at_time % 60) : String(smart_array[index].at_time % 60));
+    }
+    if (smart_array[index].start_time > -1 && smart_array[index].end_time > -1) {
+        json_object["between_hours"][0] = String(smart_array[index].start_time / 60) + ":" + (smart_array[index].start_time % 60 < 10 ? "0" + String(smart_array[index].start_time % 60) : String(smart_array[index].start_time % 60));
+        json_object["between_hours"][1] = String(smart_array[index].end_time / 60) + ":" + (smart_array[index].end_time % 60 < 10 ? "0" + String(smart_array[index].end_time % 60) : String(smart_array[index].end_time % 60));
+    } else {
+      if (smart_array[index].start_time > -1) {
+        json_object["start_time"] = String(smart_array[index].start_time / 60) + ":" + (smart_array[index].start_time % 60 < 10 ? "0" + String(smart_array[index].start_time % 60) : String(smart_array[index].start_time % 60));
       }
-      if (smart_array[i].has_lowering_at_sunset_offset) {
-        json_object[String(count)]["has_lowering_at_sunset_offset"] = true;
+      if (smart_array[index].end_time > -1) {
+        json_object["end_time"] = String(smart_array[index].end_time / 60) + ":" + (smart_array[index].end_time % 60 < 10 ? "0" + String(smart_array[index].end_time % 60) : String(smart_array[index].end_time % 60));
       }
     }
-    if (smart_array[i].at_sunrise && !raw) {
-      json_object[String(count)]["at_sunrise"] = true;
-      if (smart_array[i].sunrise_offset != 0) {
-        json_object[String(count)]["sunrise_offset"] = smart_array[i].sunrise_offset;
+  }
+  if (smart_array[index].at_sunset) {
+    if (!raw) {
+      json_object["at_sunset"] = true;
+      if (smart_array[index].sunset_offset != 0) {
+        json_object["sunset_offset"] = smart_array[index].sunset_offset;
       }
     }
-    if (smart_array[i].at_dusk > -1) {
-      if (!raw) {
-        if (smart_array[i].at_dusk > 0) {
-          json_object[String(count)]["at_dusk"] = smart_array[i].at_dusk;
-        } else {
-          json_object[String(count)]["at_dusk"] = true;
-        }
-        if (smart_array[i].dusk_offset > 0) {
-          json_object[String(count)]["dusk_offset"] = smart_array[i].dusk_offset;
-        }
-      }
-      if (smart_array[i].local_dusk_time > 0) {
-        if (raw) {
-          json_object[String(count)]["local_dusk_time"] = smart_array[i].local_dusk_time;
-        } else {
-          json_object[String(count)]["local_dusk_time"] = String(smart_array[i].local_dusk_time / 60) + ":" + (smart_array[i].local_dusk_time % 60 < 10 ? "0" + String(smart_array[i].local_dusk_time % 60) : String(smart_array[i].local_dusk_time % 60));
-        }
+    if (smart_array[index].has_lowering_at_sunset_offset) {
+      json_object["has_lowering_at_sunset_offset"] = true;
+    }
+  }
+  if (smart_array[index].at_sunrise && !raw) {
+    json_object["at_sunrise"] = true;
+    if (smart_array[index].sunrise_offset != 0) {
+      json_object["sunrise_offset"] = smart_array[index].sunrise_offset;
+    }
+  }
+  if (smart_array[index].at_dusk > -1) {
+    if (!raw) {
+      if (smart_array[index].at_dusk > 0) {
+        json_object["at_dusk"] = smart_array[index].at_dusk;
+      } else {
+        json_object["at_dusk"] = true;
       }
-      if (smart_array[i].dusk_day > -1) {
-        if (smart_array[i].dusk_day > 0 || raw) {
-          json_object[String(count)]["dusk_day"] = smart_array[i].dusk_day;
-        } else {
-          json_object[String(count)]["dusk_log"] = true;
-        }
+      if (smart_array[index].dusk_offset > 0) {
+        json_object["dusk_offset"] = smart_array[index].dusk_offset;
       }
     }
-    if (smart_array[i].at_dawn > -1) {
-      if (!raw) {
-        if (smart_array[i].at_dawn > 0) {
-          json_object[String(count)]["at_dawn"] = smart_array[i].at_dawn;
-        } else {
-          json_object[String(count)]["at_dawn"] = true;
-        }
-        if (smart_array[i].dawn_offset > 0) {
-          json_object[String(count)]["dawn_offset"] = smart_array[i].dawn_offset;
-        }
+    if (smart_array[index].local_dusk_time > 0) {
+      if (raw) {
+        json_object["local_dusk_time"] = smart_array[index].local_dusk_time;
+      } else {
+        json_object["local_dusk_time"] = String(smart_array[index].local_dusk_time / 60) + ":" + (smart_array[index].local_dusk_time % 60 < 10 ? "0" + String(smart_array[index].local_dusk_time % 60) : String(smart_array[index].local_dusk_time % 60));
       }
-      if (smart_array[i].local_dawn_time > 0) {
-        if (raw) {
-          json_object[String(count)]["local_dawn_time"] = smart_array[i].local_dawn_time;
-        } else {
-          json_object[String(count)]["local_dawn_time"] = String(smart_array[i].local_dawn_time / 60) + ":" + (smart_array[i].local_dawn_time % 60 < 10 ? "0" + String(smart_array[i].local_dawn_time % 60) : String(smart_array[i].local_dawn_time % 60));
-        }
+    }
+    if (smart_array[index].dusk_day > -1) {
+      if (smart_array[index].dusk_day > 0 || raw) {
+        json_object["dusk_day"] = smart_array[index].dusk_day;
+      } else {
+        json_object["dusk_log"] = true;
       }
-      if (smart_array[i].dawn_day > -1) {
-        if (smart_array[i].dawn_day > 0 || raw) {
-          json_object[String(count)]["dawn_day"] = smart_array[i].dawn_day;
-        } else {
-          json_object[String(count)]["dawn_log"] = true;
-        }
+    }
+  }
+  if (smart_array[index].at_dawn > -1) {
+    if (!raw) {
+      if (smart_array[index].at_dawn > 0) {
+        json_object["at_dawn"] = smart_array[index].at_dawn;
+      } else {
+        json_object["at_dawn"] = true;
+      }
+      if (smart_array[index].dawn_offset > 0) {
+        json_object["dawn_offset"] = smart_array[index].dawn_offset;
       }
     }
-    #ifdef light_switch
-      if (smart_array[i].at_switch != "?") {
-        if (!raw) {
-          json_object[String(count)]["at_switch"] = smart_array[i].at_switch;
-          if (smart_array[i].switch_offset > 0) {
-            json_object[String(count)]["switch_offset"] = smart_array[i].switch_offset;
-          }
-        }
-        if (smart_array[i].switch_offset_countdown > 0) {
-          json_object[String(count)]["switch_offset_countdown"] = smart_array[i].switch_offset_countdown;
-        }
+    if (smart_array[index].local_dawn_time > 0) {
+      if (raw) {
+        json_object["local_dawn_time"] = smart_array[index].local_dawn_time;
+      } else {
+        json_object["local_dawn_time"] = String(smart_array[index].local_dawn_time / 60) + ":" + (smart_array[index].local_dawn_time % 60 < 10 ? "0" + String(smart_array[index].local_dawn_time % 60) : String(smart_array[index].local_dawn_time % 60));
       }
-    #endif
-    #ifdef blinds
-      if (smart_array[i].at_blinds != "?") {
-        if (!raw) {
-          json_object[String(count)]["at_blinds"] = smart_array[i].at_blinds;
-          if (smart_array[i].blinds_offset > 0) {
-            json_object[String(count)]["blinds_offset"] = smart_array[i].blinds_offset;
-          }
+    }
+    if (smart_array[index].dawn_day > -1) {
+      if (smart_array[index].dawn_day > 0 || raw) {
+        json_object["dawn_day"] = smart_array[index].dawn_day;
+      } else {
+        json_object["dawn_log"] = true;
+      }
+    }
+  }
+  #ifdef light_switch
+    if (smart_array[index].at_switch != "?") {
+      if (!raw) {
+        json_object["at_switch"] = smart_array[index].at_switch;
+        if (smart_array[index].switch_offset > 0) {
+          json_object["switch_offset"] = smart_array[index].switch_offset;
         }
-        if (smart_array[i].blinds_offset_countdown > 0) {
-          json_object[String(count)]["blinds_offset_countdown"] = smart_array[i].blinds_offset_countdown;
+      }
+      if (smart_array[index].switch_offset_countdown > 0) {
+        json_object["switch_offset_countdown"] = smart_array[index].switch_offset_countdown;
+      }
+    }
+  #endif
+  #ifdef blinds
+    if (smart_array[index].at_blinds != "?") {
+      if (!raw) {
+        json_object["at_blinds"] = smart_array[index].at_blinds;
+        if (smart_array[index].blinds_offset > 0) {
+          json_object["blinds_offset"] = smart_array[index].blinds_offset;
         }
       }
-    #endif
-    #ifdef thermostat
-      if (smart_array[i].at_thermostat != "?") {
-        if (!raw) {
-          json_object[String(count)]["at_thermostat"] = smart_array[i].at_thermostat;
-          if (smart_array[i].thermostat_offset > 0) {
-            json_object[String(count)]["thermostat_offset"] = smart_array[i].thermostat_offset;
-          }
+      if (smart_array[index].blinds_offset_countdown > 0) {
+        json_object["blinds_offset_countdown"] = smart_array[index].blinds_offset_countdown;
+      }
+    }
+  #endif
+  #ifdef thermostat
+    if (smart_array[index].at_thermostat != no_setpoint) {
+      if (!raw) {
+        json_object["at_thermostat"] = fromFixedPoint(smart_array[index].at_thermostat);
+        if (smart_array[index].thermostat_direction != 0) {
+          json_object["thermostat_direction"] = smart_array[index].thermostat_direction > 0 ? "rising" : "falling";
         }
-        if (smart_array[i].thermostat_offset_countdown > 0) {
-          json_object[String(count)]["thermostat_offset_countdown"] = smart_array[i].thermostat_offset_countdown;
+        if (smart_array[index].thermostat_offset > 0) {
+          json_object["thermostat_offset"] = smart_array[index].thermostat_offset;
         }
       }
-    #endif
-    #ifdef chain
-      if (smart_array[i].at_chain != "?") {
-        if (!raw) {
-          json_object[String(count)]["at_chain"] = smart_array[i].at_chain;
-          if (smart_array[i].chain_offset > 0) {
-            json_object[String(count)]["chain_offset"] = smart_array[i].chain_offset;
-          }
-        }
-        if (smart_array[i].chain_offset_countdown > 0) {
-          json_object[String(count)]["chain_offset_countdown"] = smart_array[i].chain_offset_countdown;
+      if (smart_array[index].thermostat_offset_countdown > 0) {
+        json_object["thermostat_offset_countdown"] = smart_array[index].thermostat_offset_countdown;
+      }
+    }
+  #endif
+  #ifdef chain
+    if (smart_array[index].at_chain != "?") {
+      if (!raw) {
+        json_object["at_chain"] = smart_array[index].at_chain;
+        if (smart_array[index].chain_offset > 0) {
+          json_object["chain_offset"] = smart_array[index].chain_offset;
         }
       }
-    #endif
-    if (smart_array[i].must_be_ != "?" && !raw) {
-      json_object[String(count)]["must_be"] = smart_array[i].must_be_;
+      if (smart_array[index].chain_offset_countdown > 0) {
+        json_object["chain_offset_countdown"] = smart_array[index].chain_offset_countdown;
+      }
     }
-    if (smart_array[i].twilight_must_be_ != "?" && !raw) {
-      json_object[String(count)]["twilight_must_be"] = smart_array[i].twilight_must_be_;
+  #endif
+  if (!raw) {
+    String must_be = getSmartMustBe(index);
+    if (must_be != "?") {
+      json_object["must_be"] = must_be;
     }
-    if (smart_array[i].lead_u_time > 0) {
-      if (raw) {
-        json_object[String(count)]["lead_time"] = smart_array[i].lead_u_time;
-      } else {
-        DateTime lead_dt(smart_array[i].lead_u_time + offset + (dst ? 3600 : 0));
-        json_object[String(count)]["lead_time"] = String(lead_dt.year()) + "-" + corectDateTime(lead_dt.month()) + "-" + corectDateTime(lead_dt.day()) + " " + corectDateTime(lead_dt.hour()) + ":" + corectDateTime(lead_dt.minute());
-      }
+    if (smart_array[index].twilight_must_be > 0) {
+      json_object["twilight_must_be"] = getSmartTwilightMustBe(index);
+    }
+  }
+  if (smart_array[index].lead_u_time > 0) {
+    if (raw) {
+      json_object["lead_time"] = smart_array[index].lead_u_time;
+    } else {
+      DateTime lead_dt(smart_array[index].lead_u_time + offset + (dst ? 3600 : 0));
+      json_object["lead_time"] = String(lead_dt.year()) + "-" + corectDateTime(lead_dt.month()) + "-" + corectDateTime(lead_dt.day()) + " " + corectDateTime(lead_dt.hour()) + ":" + corectDateTime(lead_dt.minute());
+    }
+  }
+
+  return true;
+}
+
+void sendSmartJson(bool raw) {
+  DynamicJsonDocument json_object(smart_detail_size);
+  String chunk;
+  int count = 0;
+
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "text/plain", "");
+  for (int i = 0; i < smart_count; i++) {
+    if (getSmartJson(i, raw, json_object)) {
+      chunk = (count > 0 ? ",\"" : "{\"") + String(count) + "\":";
+      serializeJson(json_object, chunk);
+      server.sendContent(chunk);
+      count++;
     }
   }
+  chunk = count > 0 ? "" : "{";
   if (raw) {
-    json_object["count"] = count + 1;
+    chunk += String(count > 0 ? "," : "") + "\"count\":" + String(count);
   }
+  server.sendContent(chunk + "}");
+  server.sendContent("");
+}
 
-  return json_object;
+bool hasSmartState(int index) {
+  bool result = (smart_array[index].at_sunset && smart_array[index].has_lowering_at_sunset_offset) || smart_array[index].lead_u_time > 0
+  || (smart_array[index].at_dusk > -1 && (smart_array[index].local_dusk_time > 0 || smart_array[index].dusk_day > -1))
+  || (smart_array[index].at_dawn > -1 && (smart_array[index].local_dawn_time > 0 || smart_array[index].dawn_day > -1));
+  #ifdef light_switch
+    result |= smart_array[index].at_switch != "?" && smart_array[index].switch_offset_countdown > 0;
+  #endif
+  #ifdef blinds
+    result |= smart_array[index].at_blinds != "?" && smart_array[index].blinds_offset_countdown > 0;
+  #endif
+  #ifdef thermostat
+    result |= smart_array[index].at_thermostat != no_setpoint && smart_array[index].thermostat_offset_countdown > 0;
+  #endif
+  #ifdef chain
+    result |= smart_array[index].at_chain != "?" && smart_array[index].chain_offset_countdown > 0;
+  #endif
+  return result;
 }
 
-void readSmart() {
+void restoreSmart(int index, JsonObject json_object) {
+  smart_array[index].has_lowering_at_sunset_offset = json_object.containsKey("has_lowering_at_sunset_offset");
+  if (json_object.containsKey("local_dusk_time")) {
+    smart_array[index].local_dusk_time = json_object["local_dusk_time"].as<int>();
+  }
+  if (json_object.containsKey("dusk_day")) {
+    smart_array[index].dusk_day = json_object["dusk_day"].as<int>();
+  }
+  if (json_object.containsKey("local_dawn_time")) {
+    smart_array[index].local_dawn_time = json_object["local_dawn_time"].as<int>();
+  }
+  if (json_object.containsKey("dawn_day")) {
+    smart_array[index].dawn_day = json_object["dawn_day"].as<int>();
+  }
+  #ifdef light_switch
+    if (json_object.containsKey("switch_offset_countdown")) {
+      smart_array[index].switch_offset_countdown = json_object["switch_offset_countdown"].as<int>();
+    }
+  #endif
+  #ifdef blinds
+    if (json_object.containsKey("blinds_offset_countdown")) {
+      smart_array[index].blinds_offset_countdown = json_object["blinds_offset_countdown"].as<int>();
+    }
+  #endif
+  #ifdef thermostat
+    if (json_object.containsKey("thermostat_offset_countdown")) {
+      smart_array[index].thermostat_offset_countdown = json_object["thermostat_offset_countdown"].as<int>();
+    }
+  #endif
+  #ifdef chain
+    if (json_object.containsKey("chain_offset_countdown")) {
+      smart_array[index].chain_offset_countdown = json_object["chain_offset_countdown"].as<int>();
+    }
+  #endif
+  if (json_object.containsKey("lead_time")) {
+    smart_array[index].lead_u_time = json_object["lead_time"].as<int>();
+  }
+  smart_array[index].state_changed = true;
+}
+
+int replaySmartFile(String name) { // One JSON object per line, a torn last line ends the replay.
+  size_t length;
+  uint8_t* content = readCheckedFile(name, length);
+  if (content == 0) {
+    return 0;
+  }
+
+  int entries = 0;
+  uint32_t hash;
+  size_t position = 0;
+  DynamicJsonDocument json_object(smart_state_size);
+  while (position < length) {
+    const char* line = (const char*)content + position;
+    const char* line_end = (const char*)memchr(line, '\n', length - position);
+    size_t line_length = line_end != 0 ? line_end - line : length - position;
+    if (deserializeJson(json_object, line, line_length)) {
+      break;
+    }
+    entries++;
+    hash = json_object["hash"].as<uint32_t>();
+    for (int j = findSmartHash(hash); j < smart_count && smart_array[smart_hash_array[j]].hash == hash; j++) {
+      restoreSmart(smart_hash_array[j], json_object.as<JsonObject>());
+    }
+    position += line_length + 1;
+  }
+  delete [] content;
+
+  return entries;
+}
+
+bool migrateSmartFile() { // One-time upgrade of a /smart.txt written as a single {"0":{"smart":...},"count":n} object.
   File file = LittleFS.open("/smart.txt", "r");
   if (!file) {
-    return;
+    return false;
   }
 
-  DynamicJsonDocument json_object(smart_count * 400);
+  char head[8] = "";
+  file.readBytes(head, 7);
+  if (file.size() < 8 || head[0] != '{' || strncmp(head, "{\"hash\"", 7) == 0) {
+    file.close();
+    return false;
+  }
+
+  file.seek(0);
+  DynamicJsonDocument json_object(smart_count * 400 + 64);
   DeserializationError deserialization_error = deserializeJson(json_object, file);
+  file.close();
+  if (deserialization_error || !json_object.containsKey("count")) {
+    return false;
+  }
 
-  if (deserialization_error) {
-    note("Smart file error: " + String(deserialization_error.f_str()));
-    file.close();
+  uint32_t hash;
+  int count = json_object["count"].as<int>();
+  for (int i = 0; i < count; i++) {
+    hash = hashSmart(json_object[String(i)]["smart"].as<String>());
+    for (int j = findSmartHash(hash); j < smart_count && smart_array[smart_hash_array[j]].hash == hash; j++) {
+      restoreSmart(smart_hash_array[j], json_object[String(i)].as<JsonObject>());
+    }
+  }
+
+  noteInfo(F("Smart file migrated"));
+  return true;
+}
+
+void readSmart() {
+  bool migrated = migrateSmartFile();
+  if (!migrated) {
+    replaySmartFile("/smart.txt");
+  }
+  int entries = replaySmartFile("/journal.txt");
+
+  int result = 0;
+  for (int i = 0; i < smart_count; i++) {
+    if (smart_array[i].state_changed) {
+      result++;
+    }
+  }
+  if (result > 0) {
+    noteInfo(String(result) + "/" + String(smart_count) + " Smart(s) restored");
+  }
+
+  if (entries > 0 || migrated) {
+    compactSmartJournal();
+  } else {
+    for (int i = 0; i < smart_count; i++) {
+      smart_array[i].state_changed = false;
+    }
+  }
+}
+
+void writeSmartState(String& content, int index, DynamicJsonDocument& json_object) {
+  json_object.clear();
+  json_object["hash"] = smart_array[index].hash;
+  if (smart_array[index].has_lowering_at_sunset_offset) {
+    json_object["has_lowering_at_sunset_offset"] = true;
+  }
+  json_object["local_dusk_time"] = smart_array[index].local_dusk_time;
+  json_object["dusk_day"] = smart_array[index].dusk_day;
+  json_object["local_dawn_time"] = smart_array[index].local_dawn_time;
+  json_object["dawn_day"] = smart_array[index].dawn_day;
+  #ifdef light_switch
+    json_object["switch_offset_countdown"] = smart_array[index].switch_offset_countdown;
+  #endif
+  #ifdef blinds
+    json_object["blinds_offset_countdown"] = smart_array[index].blinds_offset_countdown;
+  #endif
+  #ifdef thermostat
+    json_object["thermostat_offset_countdown"] = smart_array[index].thermostat_offset_countdown;
+  #endif
+  #ifdef chain
+    json_object["chain_offset_countdown"] = smart_array[index].chain_offset_countdown;
+  #endif
+  json_object["lead_time"] = smart_array[index].lead_u_time;
+  String line;
+  serializeJson(json_object, line);
+  content += line + "\n";
+}
+
+void journalSmart() {
+  File file = LittleFS.open("/journal.txt", "a");
+  if (!file) {
     return;
   }
 
+  String content;
+  DynamicJsonDocument json_object(smart_state_size);
+  for (int i = 0; i < smart_count; i++) {
+    if (smart_array[i].state_changed) {
+      writeSmartState(content, i, json_object);
+      smart_array[i].state_changed = false;
+    }
+  }
+  file.print(content);
+
+  bool compaction = file.size() > journal_limit;
   file.close();
 
-  if (!(json_object.containsKey("count") && json_object["count"].as<int>() > 0)) {
+  if (compaction) {
+    compactSmartJournal();
+  }
+}
+
+void compactSmartJournal() { // The journal is only dropped once the new /smart.txt has been verified.
+  String content;
+  DynamicJsonDocument json_object(smart_state_size);
+  for (int i = 0; i < smart_count; i++) {
+    if (hasSmartState(i)) {
+      writeSmartState(content, i, json_object);
+    }
+  }
+  if (!writeCheckedFile("/smart.txt", (const uint8_t*)content.c_str(), content.length())) {
+    noteError(F("Saving the smart state failed!"));
     return;
   }
 
-  int count = json_object["count"].as<int>();
-  JsonObject json_object_2;
-  int result = 0;
-  int i = -1;
-  while (++i < smart_count) {
-    for (int j = 0; j < count; j++) {
-      json_object_2 = json_object[String(j)];
-      if (smart_array[i].smart_string == json_object_2["smart"].as<String>()) {
-        smart_array[i].has_lowering_at_sunset_offset = json_object_2.containsKey("has_lowering_at_sunset_offset");
-        if (json_object_2.containsKey("local_dusk_time")) {
-          smart_array[i].local_dusk_time = json_object_2["local_dusk_time"].as<int>();
+  LittleFS.remove("/journal.txt");
+  for (int i = 0; i < smart_count; i++) {
+    smart_array[i].state_changed = false;
+  }
+}
+
+bool readSmartNumber(const char* text, int& position, int end, int32_t& value, int decimals, int32_t limit = INT16_MAX) {
+  int start = position;
+  bool negative = position < end && text[position] == '-';
+  if (negative) {
+    position++;
+  }
+
+  int digits = 0;
+  value = 0;
+  while (position < end && isDigit(text[position])) {
+    if (value > (limit - (text[position] - '0')) / 10) {
+      position = start;
+      return false;
+    }
+    value = value * 10 + (text[position++] - '0');
+    digits++;
+  }
+  if (decimals > 0 && position < end && text[position] == '.') {
+    position++;
+    while (position < end && isDigit(text[position])) {
+      if (decimals > 0) {
+        if (value > (limit - (text[position] - '0')) / 10) {
+          position = start;
+          return false;
+        }
+        value = value * 10 + (text[position] - '0');
+        decimals--;
+      }
+      position++;
+      digits++;
+    }
+  }
+  while (decimals-- > 0) {
+    if (value > limit / 10) {
+      position = start;
+      return false;
+    }
+    value *= 10;
+  }
+  if (negative) {
+    value = -value;
+  }
+
+  return digits > 0;
+}
+
+int findSmartBracket(const char* text, int position, int end) {
+  while (position < end && text[position] != ')') {
+    position++;
+  }
+  return position < end ? position : -1;
+}
+
+void clearSmart(int index) {
+  Smart& smart = smart_array[index];
+  smart.enabled = true;
+  smart.any_trigger_required = false;
+  smart.action = no_action;
+  smart.action_value = 0;
+  smart.action_start = 0;
+  smart.action_length = 0;
+  smart.at_time = -1;
+  smart.start_time = -1;
+  smart.end_time = -1;
+  smart.at_sunset = false;
+  smart.sunset_offset = 0;
+  smart.has_lowering_at_sunset_offset = false;
+  smart.state_changed = false;
+  smart.at_sunrise = false;
+  smart.sunrise_offset = 0;
+  smart.at_dusk = -1;
+  smart.local_dusk_time = -1;
+  smart.dusk_offset = 0;
+  smart.dusk_day = 0;
+  smart.at_dawn = -1;
+  smart.local_dawn_time = -1;
+  smart.dawn_offset = 0;
+  smart.dawn_day = 0;
+  #ifdef light_switch
+    smart.at_switch = "?";
+    smart.switch_offset = 0;
+    smart.switch_offset_countdown = -1;
+  #endif
+  #ifdef blinds
+    smart.at_blinds = "?";
+    smart.blinds_offset = 0;
+    smart.blinds_offset_countdown = -1;
+  #endif
+  #ifdef thermostat
+    smart.at_thermostat = no_setpoint;
+    smart.thermostat_offset = 0;
+    smart.thermostat_offset_countdown = -1;
+    smart.thermostat_direction = 0;
+    smart.thermostat_armed = crossing_unknown;
+  #endif
+  #ifdef chain
+    smart.at_chain = "?";
+    smart.chain_offset = 0;
+    smart.chain_offset_countdown = -1;
+  #endif
+  #ifdef thermostat
+    smart.must_be.condition = no_condition;
+    smart.must_be.target = state_target;
+    smart.must_be.operand = 0;
+  #else
+    smart.must_be_ = "?";
+  #endif
+  smart.twilight_must_be = 0;
+  smart.lead_u_time = 0;
+  smart.lead_start = -1;
+  smart.days = 0;
+  smart.syntax_error = -1;
+}
+
+int parseSmart(int index) { // Returns the position of a syntax error or -1.
+  Smart& smart = smart_array[index];
+  const char* text = smart.smart_string.c_str();
+  int end = smart.smart_string.length();
+
+  clearSmart(index);
+
+  const char* day;
+  #if defined(light_switch) || defined(blinds)
+    bool what[4] = {false, false, false, false};
+  #endif
+  int position = 1;
+
+  while (position < end && text[position] != '|' && text[position] != '&') {
+    char c = text[position];
+    if (c == '/') {
+      smart.enabled = false;
+    } else if ((day = strchr(days_of_the_week, c)) != NULL) {
+      smart.days |= 1 << (day - days_of_the_week);
+    #if defined(light_switch) || defined(blinds)
+      } else if (c >= '1' && c <= '4') {
+        what[c - '1'] = true;
+    #endif
+    } else {
+      return position;
+    }
+    position++;
+  }
+
+  int trigger_start = end;
+  if (position < end) {
+    if (text[position] == '&') {
+      smart.any_trigger_required = true;
+      trigger_start = position + 1;
+    } else {
+      int action_end = position + 1;
+      while (action_end < end && text[action_end] != '|' && text[action_end] != '&') {
+        action_end++;
+      }
+      if (action_end < end) {
+        smart.any_trigger_required = text[action_end] == '&';
+        if (action_end > 255) {
+          return 255;
+        }
+        smart.action_start = position + 1;
+        smart.action_length = action_end - smart.action_start;
+        trigger_start = action_end + 1;
+      } else {
+        trigger_start = position + 1;
+      }
+    }
+  }
+
+  if (smart.action_length > 0) {
+    const char* action = text + smart.action_start;
+    const char* dot = (const char*)memchr(action, '.', smart.action_length);
+    const char* semicolon = (const char*)memchr(action, ';', smart.action_length);
+    int32_t value = 0;
+    int action_position = smart.action_start;
+    if (dot != NULL) {
+      if (semicolon != NULL && dot < semicolon) {
+        smart.action = remote_action;
+      } else {
+        if (!readSmartNumber(text, action_position, smart.action_start + smart.action_length, value, 2)) {
+          return action_position;
         }
-        if (json_object_2.containsKey("dusk_day")) {
-          smart_array[i].dusk_day = json_object_2["dusk_day"].as<int>();
+        smart.action = decimal_action;
+        smart.action_value = value;
+      }
+    } else {
+      smart.action = value_action;
+      #ifdef thermostat
+        smart.action_value = memchr(action, '1', smart.action_length) != NULL ? 1 : 0;
+      #else
+        readSmartNumber(text, action_position, smart.action_start + smart.action_length, value, 0);
+        smart.action_value = value;
+      #endif
+    }
+  }
+
+  bool cloudiness = false;
+  int32_t cloudiness_offset = -1;
+  int32_t value;
+  int bracket;
+  position = trigger_start;
+
+  while (position < end) {
+    char c = text[position];
+    bool arguments = position + 1 < end && text[position + 1] == '(';
+    bracket = arguments ? findSmartBracket(text, position + 2, end) : -1;
+    if (arguments && bracket == -1) {
+      return position + 1;
+    }
+
+    if (isDigit(c) || c == '-') {
+      if (!readSmartNumber(text, position, end, value, 0) || position >= end || text[position] != '_') {
+        return position;
+      }
+      smart.at_time = value;
+      position++;
+      continue;
+    }
+
+    if (c == 'r' && position + 2 < end && text[position + 1] == '2' && text[position + 2] == '(') {
+      bracket = findSmartBracket(text, position + 3, end);
+      if (bracket == -1) {
+        return position + 2;
+      }
+      for (position += 3; position < bracket; position++) {
+        const char* letter = strchr(twilight_letters, text[position]);
+        if (letter == NULL) {
+          return position;
         }
-        if (json_object_2.containsKey("local_dawn_time")) {
-          smart_array[i].local_dawn_time = json_object_2["local_dawn_time"].as<int>();
+        smart.twilight_must_be |= 1 << (letter - twilight_letters);
+      }
+      position = bracket + 1;
+      continue;
+    }
+
+    position += arguments ? 2 : 1;
+    switch (c) {
+      case 'n':
+        smart.at_sunset = true;
+        if (arguments) {
+          if (!readSmartNumber(text, position, bracket, value, 0)) {
+            return position;
+          }
+          smart.sunset_offset = value;
+        }
+        break;
+      case 'd':
+        smart.at_sunrise = true;
+        if (arguments) {
+          if (!readSmartNumber(text, position, bracket, value, 0)) {
+            return position;
+          }
+          smart.sunrise_offset = value;
+        }
+        break;
+      case '<':
+      case '>':
+        value = 0;
+        if (arguments) {
+          if (!readSmartNumber(text, position, bracket, value, 0) || position >= bracket || text[position++] != ';') {
+            return position;
+          }
         }
-        if (json_object_2.containsKey("dawn_day")) {
-          smart_array[i].dawn_day = json_object_2["dawn_day"].as<int>();
+        if (c == '<') {
+          smart.at_dusk = value;
+        } else {
+          smart.at_dawn = value;
         }
-        #ifdef light_switch
-          if (json_object_2.containsKey("switch_offset_countdown")) {
-            smart_array[i].switch_offset_countdown = json_object_2["switch_offset_countdown"].as<int>();
+        if (arguments) {
+          if (!readSmartNumber(text, position, bracket, value, 0)) {
+            return position;
           }
-        #endif
-        #ifdef blinds
-          if (json_object_2.containsKey("blinds_offset_countdown")) {
-            smart_array[i].blinds_offset_countdown = json_object_2["blinds_offset_countdown"].as<int>();
+          if (c == '<') {
+            smart.dusk_offset = value;
+          } else {
+            smart.dawn_offset = value;
           }
-        #endif
+        }
+        break;
+      case 'z':
+        cloudiness = true;
+        if (arguments) {
+          if (!readSmartNumber(text, position, bracket, cloudiness_offset, 0)) {
+            return position;
+          }
+        }
+        break;
+      case 'h':
+        if (!arguments || !readSmartNumber(text, position, bracket, value, 0) || position >= bracket || text[position++] != ';') {
+          return position;
+        }
+        smart.start_time = value;
+        if (!readSmartNumber(text, position, bracket, value, 0)) {
+          return position;
+        }
+        smart.end_time = value;
+        break;
+      case 'r':
+        if (!arguments) {
+          return position - 1;
+        }
         #ifdef thermostat
-          if (json_object_2.containsKey("thermostat_offset_countdown")) {
-            smart_array[i].thermostat_offset_countdown = json_object_2["thermostat_offset_countdown"].as<int>();
+          if (memchr(text + position, '.', bracket - position) != NULL) {
+            smart.must_be.target = temperature_target;
+            smart.must_be.condition = text[position] == '<' ? less_condition : (text[position] == '>' ? greater_condition : equal_condition);
+            if (smart.must_be.condition != equal_condition) {
+              position++;
+            }
+            if (!readSmartNumber(text, position, bracket, value, 2)) {
+              return position;
+            }
+            smart.must_be.operand = value;
+          } else {
+            smart.must_be.target = state_target;
+            smart.must_be.condition = equal_condition;
+            smart.must_be.operand = memchr(text + position, '1', bracket - position) != NULL ? 1 : 0;
           }
+        #else
+          smart.must_be_ = smart.smart_string.substring(position, bracket);
         #endif
-        #ifdef chain
-          if (json_object_2.containsKey("chain_offset_countdown")) {
-            smart_array[i].chain_offset_countdown = json_object_2["chain_offset_countdown"].as<int>();
+        position = bracket;
+        break;
+      case 'e':
+        smart.lead_start = position - 2;
+        if (!arguments || !readSmartNumber(text, position, bracket, value, 0, INT32_MAX)) {
+          return position;
+        }
+        smart.lead_u_time = value;
+        break;
+      #ifdef light_switch
+        case 'l':
+          if (!arguments) {
+            return position - 1;
           }
-        #endif
-        if (json_object_2.containsKey("lead_time")) {
-          smart_array[i].lead_u_time = json_object_2["lead_time"].as<int>();
+          value = (const char*)memchr(text + position, ';', bracket - position) != NULL ? (const char*)memchr(text + position, ';', bracket - position) - text : bracket;
+          smart.at_switch = smart.smart_string.substring(position, value);
+          if (value < bracket) {
+            position = value + 1;
+            if (!readSmartNumber(text, position, bracket, value, 0)) {
+              return position;
+            }
+            smart.switch_offset = value;
+          }
+          position = bracket;
+          break;
+      #endif
+      #ifdef blinds
+        case 'b': {
+          if (!arguments) {
+            return position - 1;
+          }
+          int semicolon = 0;
+          int last_semicolon = bracket;
+          for (int j = position; j < bracket; j++) {
+            if (text[j] == ';') {
+              semicolon++;
+              last_semicolon = j;
+            }
+          }
+          if (semicolon == 1 || semicolon == 3) {
+            smart.at_blinds = smart.smart_string.substring(position, last_semicolon);
+            position = last_semicolon + 1;
+            if (!readSmartNumber(text, position, bracket, value, 0)) {
+              return position;
+            }
+            smart.blinds_offset = value;
+          } else {
+            smart.at_blinds = smart.smart_string.substring(position, bracket);
+          }
+          position = bracket;
+          break;
         }
-        result++;
+      #endif
+      #ifdef thermostat
+        case 't':
+          if (arguments && (text[position] == '<' || text[position] == '>')) {
+            smart.thermostat_direction = text[position++] == '>' ? 1 : -1;
+          }
+          if (!arguments || !readSmartNumber(text, position, bracket, value, 2)) {
+            return position;
+          }
+          smart.at_thermostat = value;
+          if (position < bracket && text[position] == ';') {
+            position++;
+            if (!readSmartNumber(text, position, bracket, value, 0)) {
+              return position;
+            }
+            smart.thermostat_offset = value;
+          }
+          break;
+      #endif
+      #ifdef chain
+        case 'c':
+          if (!arguments) {
+            return position - 1;
+          }
+          value = (const char*)memchr(text + position, ';', bracket - position) != NULL ? (const char*)memchr(text + position, ';', bracket - position) - text : bracket;
+          smart.at_chain = smart.smart_string.substring(position, value);
+          if (value < bracket) {
+            position = value + 1;
+            if (!readSmartNumber(text, position, bracket, value, 0)) {
+              return position;
+            }
+            smart.chain_offset = value;
+          }
+          position = bracket;
+          break;
+      #endif
+      default:
+        return position - (arguments ? 2 : 1);
+    }
+
+    if (arguments) {
+      if (position != bracket) {
+        return position;
       }
+      position++;
     }
   }
-  if (result > 0) {
-    note(String(result) + "/" + String(smart_count) + " Smart(s) restored");
+
+  if (cloudiness) {
+    smart.at_dusk = 0;
+    smart.local_dusk_time = -1;
+    smart.dusk_day = -1;
+    smart.at_dawn = 0;
+    smart.local_dawn_time = -1;
+    smart.dawn_day = -1;
+    if (cloudiness_offset > -1) {
+      smart.dusk_offset = cloudiness_offset;
+      smart.dawn_offset = cloudiness_offset;
+    }
+  }
+
+  if (smart.days == 0) {
+    smart.days = every_day;
+  }
+  #if defined(light_switch) || defined(blinds)
+    smart.what = what[3] ? "123" : "";
+    if (!what[3]) {
+      for (int j = 0; j < 3; j++) {
+        if (what[j]) {
+          smart.what += String(j + 1);
+        }
+      }
+    }
+    if (smart.what == "") {
+      smart.what = "?";
+    }
+  #endif
+
+  return -1;
+}
+
+uint32_t hashSmart(const String& smart_string) { // FNV-1a
+  const char* text = smart_string.c_str();
+  uint32_t hash = 2166136261;
+  for (int i = 0; text[i] != '\0'; i++) {
+    if (text[i] == 'e' && text[i + 1] == '(') {
+      while (text[i + 1] != '\0' && text[i] != ')') {
+        i++;
+      }
+      continue;
+    }
+    hash = (hash ^ (uint8_t)text[i]) * 16777619;
+  }
+  return hash;
+}
+
+int compareSmartHashes(const void* a, const void* b) {
+  uint32_t first = smart_array[*(const int16_t*)a].hash;
+  uint32_t second = smart_array[*(const int16_t*)b].hash;
+  return first < second ? -1 : (first > second ? 1 : 0);
+}
+
+void setSmartHashes() {
+  if (smart_hash_array != 0) {
+    delete [] smart_hash_array;
+  }
+  smart_hash_array = new int16_t[smart_count > 0 ? smart_count : 1];
+  for (int i = 0; i < smart_count; i++) {
+    smart_array[i].hash = hashSmart(smart_array[i].smart_string);
+    smart_hash_array[i] = i;
+  }
+  qsort(smart_hash_array, smart_count, sizeof(int16_t), compareSmartHashes);
+}
+
+int findSmartHash(uint32_t hash) {
+  int low = 0;
+  int high = smart_count;
+  while (low < high) {
+    int middle = (low + high) / 2;
+    if (smart_array[smart_hash_array[middle]].hash < hash) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
   }
+  return low;
 }
 
 void setSmart(const String& smart_string) {
   if (smart_string.length() < 2) {
     smart_count = 0;
+    setSmartIndex();
     return;
   }
 
-  int count = 1;
   smart_count = 1;
   for (char b: smart_string) {
-    if (b == ',') {
-      count++;
-    }
     if (b == smart_prefix) {
       smart_count++;
     }
@@ -727,199 +1941,154 @@ void setSmart(const String& smart_string) {
   smart_array = new Smart[smart_count];
   smart_count = 0;
 
-  String single_smart_string;
+  int start = 0;
+  int end;
+  int error;
 
-  for (int i = 0; i < count; i++) {
-    single_smart_string = get1(smart_string, i, ',');
-    if (smart_prefix == single_smart_string.charAt(0)) {
-      smart_array[smart_count].smart_string = single_smart_string;
-      smart_array[smart_count].enabled = !strContains(single_smart_string, "/");
-
-      String substring = single_smart_string.substring(0, single_smart_string.indexOf(strContains(single_smart_string, "|") ? "|" : "&"));
-      smart_array[smart_count].days = strContains(substring, "o") ? "o" : "";
-      smart_array[smart_count].days += strContains(substring, "u") ? "u" : "";
-      smart_array[smart_count].days += strContains(substring, "e") ? "e" : "";
-      smart_array[smart_count].days += strContains(substring, "h") ? "h" : "";
-      smart_array[smart_count].days += strContains(substring, "r") ? "r" : "";
-      smart_array[smart_count].days += strContains(substring, "a") ? "a" : "";
-      smart_array[smart_count].days += strContains(substring, "s") ? "s" : "";
-      if (smart_array[smart_count].days == "") {
-        smart_array[smart_count].days = "ouehras";
+  while (start < (int)smart_string.length()) {
+    end = smart_string.indexOf(',', start);
+    if (end == -1) {
+      end = smart_string.length();
+    }
+    if (smart_string.charAt(start) == smart_prefix) {
+      smart_array[smart_count].smart_string = smart_string.substring(start, end);
+      error = parseSmart(smart_count);
+      if (error > -1) {
+        noteWarn("Smart syntax error at " + String(error) + ": " + smart_array[smart_count].smart_string);
+        clearSmart(smart_count);
+        smart_array[smart_count].enabled = false;
+        smart_array[smart_count].syntax_error = error;
       }
+      smart_count++;
+    }
+    start = end + 1;
+  }
 
-      #if defined(light_switch) || defined(blinds)
-        smart_array[smart_count].what = strContains(substring, 1) ? "1" : "";
-        smart_array[smart_count].what += strContains(substring, 2) ? "2" : "";
-        smart_array[smart_count].what += strContains(substring, 3) ? "3" : "";
-        smart_array[smart_count].what += strContains(substring, 4) ? "123" : "";
-        if (smart_array[smart_count].what == "") {
-          smart_array[smart_count].what = "?";
-        }
-      #endif
-
-      smart_array[smart_count].any_trigger_required = strContains(single_smart_string, "&");
-
-      smart_array[smart_count].action = "?";
-      if (smart_array[smart_count].any_trigger_required) {
-        if (strContains(single_smart_string, "|")) {
-          smart_array[smart_count].action = single_smart_string.substring(single_smart_string.indexOf("|") + 1, single_smart_string.indexOf("&"));
-        }
-        single_smart_string = single_smart_string.substring(single_smart_string.indexOf("&") + 1);
-      } else {
-        if (single_smart_string.indexOf("|") != single_smart_string.lastIndexOf("|")) {
-          smart_array[smart_count].action = single_smart_string.substring(single_smart_string.indexOf("|") + 1, single_smart_string.lastIndexOf("|"));
-        }
-        single_smart_string = single_smart_string.substring(single_smart_string.lastIndexOf("|") + 1);
-      }
+  setSmartHashes();
+  readSmart();
+  setSmartIndex();
+}
 
-      smart_array[smart_count].twilight_must_be_ = "?";
-      if (strContains(single_smart_string, "r2(")) {
-        substring = single_smart_string.substring(single_smart_string.indexOf("r2("), single_smart_string.indexOf(")", single_smart_string.indexOf("r2(")) + 1);
-        smart_array[smart_count].twilight_must_be_ = substring.substring(substring.indexOf("r2(") + 3, substring.indexOf(")", substring.indexOf("r2(")));
-        single_smart_string.replace(substring, "");
-      }
+int verifiedTime(int time) {
+  if (time > 1439) {
+    return 1439 - time;
+  }
+  return time;
+}
 
-      smart_array[smart_count].must_be_ = "?";
-      if (strContains(single_smart_string, "r(")) {
-        smart_array[smart_count].must_be_ = single_smart_string.substring(single_smart_string.indexOf("r(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("r(")));
-      }
+bool isEventSmart(int index) {
+  bool result = smart_array[index].start_time > -1 || smart_array[index].end_time > -1
+  || smart_array[index].at_dusk > -1 || smart_array[index].at_dawn > -1;
+  #ifdef light_switch
+    result |= smart_array[index].at_switch != "?";
+  #endif
+  #ifdef blinds
+    result |= smart_array[index].at_blinds != "?";
+  #endif
+  #ifdef thermostat
+    result |= smart_array[index].at_thermostat != no_setpoint;
+  #endif
+  #ifdef chain
+    result |= smart_array[index].at_chain != "?";
+  #endif
+  return result;
+}
 
-      smart_array[smart_count].at_time = -1;
-      if (strContains(single_smart_string, "_")) {
-        smart_array[smart_count].at_time = isStringDigit(single_smart_string.substring(0, single_smart_string.indexOf("_")), "-1").toInt();
-      }
+int compareSmartTriggers(const void* a, const void* b) {
+  const SmartTrigger* first = (const SmartTrigger*)a;
+  const SmartTrigger* second = (const SmartTrigger*)b;
+  if (first->minute != second->minute) {
+    return first->minute - second->minute;
+  }
+  return first->index - second->index;
+}
 
-      smart_array[smart_count].start_time = -1;
-      smart_array[smart_count].end_time = -1;
-      if (strContains(single_smart_string, "h(")) {
-        smart_array[smart_count].start_time = isStringDigit(single_smart_string.substring(single_smart_string.indexOf("h(") + 2, single_smart_string.indexOf(";", single_smart_string.indexOf("h("))), "-1").toInt();
-        smart_array[smart_count].end_time = isStringDigit(single_smart_string.substring(single_smart_string.indexOf(";", single_smart_string.indexOf("h(")) + 1, single_smart_string.indexOf(")", single_smart_string.indexOf("h("))), "-1").toInt();
-      }
+void setSmartIndex() {
+  if (smart_trigger_array != 0) {
+    delete [] smart_trigger_array;
+    smart_trigger_array = 0;
+  }
+  if (smart_event_array != 0) {
+    delete [] smart_event_array;
+    smart_event_array = 0;
+  }
+  smart_trigger_count = 0;
+  smart_event_count = 0;
 
-      smart_array[smart_count].at_sunset = strContains(single_smart_string, "n");
-      smart_array[smart_count].sunset_offset = 0;
-      smart_array[smart_count].has_lowering_at_sunset_offset = false;
-      if (strContains(single_smart_string, "n(")) {
-        smart_array[smart_count].sunset_offset = isStringDigit(single_smart_string.substring(single_smart_string.indexOf("n(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("n("))), "0").toInt();
-      }
+  #ifdef thermostat
+    setSchedule();
+  #endif
 
-      smart_array[smart_count].at_sunrise = strContains(single_smart_string, "d");
-      smart_array[smart_count].sunrise_offset = 0;
-      if (strContains(single_smart_string, "d(")) {
-        smart_array[smart_count].sunrise_offset = isStringDigit(single_smart_string.substring(single_smart_string.indexOf("d(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("d("))), "0").toInt();
-      }
+  if (smart_count == 0) {
+    return;
+  }
 
-      smart_array[smart_count].at_dusk = -1;
-      smart_array[smart_count].local_dusk_time = -1;
-      smart_array[smart_count].dusk_offset = 0;
-      smart_array[smart_count].dusk_day = 0;
-      if (strContains(single_smart_string, "<")) {
-        smart_array[smart_count].at_dusk = 0;
-        if (strContains(single_smart_string, "<(")) {
-          smart_array[smart_count].at_dusk = isStringDigit(single_smart_string.substring(single_smart_string.indexOf("<(") + 2, single_smart_string.indexOf(";", single_smart_string.indexOf("<("))), "0").toInt();
-          smart_array[smart_count].dusk_offset = isStringDigit(single_smart_string.substring(single_smart_string.indexOf(";", single_smart_string.indexOf("<(")) + 1, single_smart_string.indexOf(")", single_smart_string.indexOf("<("))), "0").toInt();
-        }
-      }
+  smart_trigger_array = new SmartTrigger[smart_count * 3];
+  smart_event_array = new int16_t[smart_count];
 
-      smart_array[smart_count].at_dawn = -1;
-      smart_array[smart_count].local_dawn_time = -1;
-      smart_array[smart_count].dawn_offset = 0;
-      smart_array[smart_count].dawn_day = 0;
-      if (strContains(single_smart_string, ">")) {
-        smart_array[smart_count].at_dawn = 0;
-        if (strContains(single_smart_string, ">(")) {
-          smart_array[smart_count].at_dawn = isStringDigit(single_smart_string.substring(single_smart_string.indexOf(">(") + 2, single_smart_string.indexOf(";", single_smart_string.indexOf(">("))), "0").toInt();
-          smart_array[smart_count].dawn_offset = isStringDigit(single_smart_string.substring(single_smart_string.indexOf(";", single_smart_string.indexOf(">(")) + 1, single_smart_string.indexOf(")", single_smart_string.indexOf(">("))), "0").toInt();
-        }
-      }
+  int minutes[3];
+  int i = -1;
+  while (++i < smart_count) {
+    if (!smart_array[i].enabled) {
+      continue;
+    }
+    if (isEventSmart(i)) {
+      smart_event_array[smart_event_count++] = i;
+      continue;
+    }
 
-      if (strContains(single_smart_string, "z")) {
-        smart_array[smart_count].at_dusk = 0;
-        smart_array[smart_count].local_dusk_time = -1;
-        smart_array[smart_count].dusk_day = -1;
-        smart_array[smart_count].at_dawn = 0;
-        smart_array[smart_count].local_dawn_time = -1;
-        smart_array[smart_count].dawn_day = -1;
-        if (strContains(single_smart_string, "z(")) {
-          smart_array[smart_count].dusk_offset = single_smart_string.substring(single_smart_string.indexOf("z(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("z("))).toInt();
-          smart_array[smart_count].dawn_offset = smart_array[smart_count].dusk_offset;
-        }
+    minutes[0] = smart_array[i].at_time;
+    minutes[1] = smart_array[i].at_sunset && next_sunset > -1 ? verifiedTime(next_sunset + smart_array[i].sunset_offset) : -1;
+    minutes[2] = smart_array[i].at_sunrise && next_sunrise > -1 ? verifiedTime(next_sunrise + smart_array[i].sunrise_offset) : -1;
+    for (int j = 0; j < 3; j++) {
+      if (minutes[j] > -1 && (j == 0 || minutes[j] != minutes[0]) && (j < 2 || minutes[j] != minutes[1])) {
+        smart_trigger_array[smart_trigger_count].minute = minutes[j];
+        smart_trigger_array[smart_trigger_count].index = i;
+        smart_trigger_count++;
       }
+    }
+  }
 
-      #ifdef light_switch
-        smart_array[smart_count].at_switch = "?";
-        smart_array[smart_count].switch_offset = 0;
-        smart_array[smart_count].switch_offset_countdown = -1;
-        if (strContains(single_smart_string, "l(")) {
-          if (strContains(single_smart_string.substring(single_smart_string.indexOf("l("), single_smart_string.indexOf(")", single_smart_string.indexOf("l("))), ";")) {
-            smart_array[smart_count].at_switch = single_smart_string.substring(single_smart_string.indexOf("l(") + 2, single_smart_string.indexOf(";", single_smart_string.indexOf("l(")));
-            smart_array[smart_count].switch_offset = isStringDigit(single_smart_string.substring(single_smart_string.indexOf(";", single_smart_string.indexOf("l(")) + 1, single_smart_string.indexOf(")", single_smart_string.indexOf("l("))), "0").toInt();
-          } else {
-            smart_array[smart_count].at_switch = single_smart_string.substring(single_smart_string.indexOf("l(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("l(")));
-          }
-        }
-      #endif
-
-      #ifdef blinds
-        smart_array[smart_count].at_blinds = "?";
-        smart_array[smart_count].blinds_offset = 0;
-        smart_array[smart_count].blinds_offset_countdown = -1;
-        if (strContains(single_smart_string, "b(")) {
-        int semicolon = 0;
-        for (char b: smart_string) b == ';' ? semicolon++ : false;
-          if (semicolon == 1 || semicolon == 3) {
-            smart_array[smart_count].at_blinds = single_smart_string.substring(single_smart_string.indexOf("b(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("b("))).substring(0, single_smart_string.substring(single_smart_string.indexOf("b(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("b("))).lastIndexOf(";"));
-            smart_array[smart_count].blinds_offset = isStringDigit(single_smart_string.substring(single_smart_string.indexOf("b(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("b("))).substring(single_smart_string.substring(single_smart_string.indexOf("b(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("b("))).lastIndexOf(";") + 1), "0").toInt();
-          } else {
-            smart_array[smart_count].at_blinds = single_smart_string.substring(single_smart_string.indexOf("b(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("b(")));
-          }
-        }
-      #endif
-
-      #ifdef thermostat
-        smart_array[smart_count].at_thermostat = "?";
-        smart_array[smart_count].thermostat_offset = 0;
-        smart_array[smart_count].thermostat_offset_countdown = 0;
-        if (strContains(single_smart_string, "t(")) {
-          if (strContains(single_smart_string.substring(single_smart_string.indexOf("t("), single_smart_string.indexOf(")", single_smart_string.indexOf("t("))), ";")) {
-            smart_array[smart_count].at_thermostat = isStringDigit(single_smart_string.substring(single_smart_string.indexOf("t(") + 2, single_smart_string.indexOf(";", single_smart_string.indexOf("t("))), "?");
-            smart_array[smart_count].thermostat_offset = isStringDigit(single_smart_string.substring(single_smart_string.indexOf(";", single_smart_string.indexOf("t(")) + 1, single_smart_string.indexOf(")", single_smart_string.indexOf("t("))), "0").toInt();
-          } else {
-            smart_array[smart_count].at_thermostat = isStringDigit(single_smart_string.substring(single_smart_string.indexOf("t(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("t("))), "?");
-          }
-        }
-      #endif
-
-      #ifdef chain
-        smart_array[smart_count].at_chain = "?";
-        smart_array[smart_count].chain_offset = 0;
-        smart_array[smart_count].chain_offset_countdown = -1;
-        if (strContains(single_smart_string, "c(")) {
-          if (strContains(single_smart_string.substring(single_smart_string.indexOf("c("), single_smart_string.indexOf(")", single_smart_string.indexOf("c("))), ";")) {
-            smart_array[smart_count].at_chain = single_smart_string.substring(single_smart_string.indexOf("c(") + 2, single_smart_string.indexOf(";", single_smart_string.indexOf("c(")));
-            smart_array[smart_count].chain_offset = isStringDigit(single_smart_string.substring(single_smart_string.indexOf(";", single_smart_string.indexOf("c(")) + 1, single_smart_string.indexOf(")", single_smart_string.indexOf("c("))), "0").toInt();
-          } else {
-            smart_array[smart_count].at_chain = single_smart_string.substring(single_smart_string.indexOf("c(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("c(")));
-          }
-        }
-      #endif
-
-      smart_array[smart_count].lead_u_time = 0;
-      if (strContains(single_smart_string, "e(")) {
-          smart_array[smart_count].lead_u_time = isStringDigit(single_smart_string.substring(single_smart_string.indexOf("e(") + 2, single_smart_string.indexOf(")", single_smart_string.indexOf("e("))), "0").toInt();
-      }
+  qsort(smart_trigger_array, smart_trigger_count, sizeof(SmartTrigger), compareSmartTriggers);
+}
 
-      smart_count++;
+int findSmartTrigger(int minute) {
+  int low = 0;
+  int high = smart_trigger_count;
+  while (low < high) {
+    int middle = (low + high) / 2;
+    if (smart_trigger_array[middle].minute < minute) {
+      low = middle + 1;
+    } else {
+      high = middle;
     }
   }
-  readSmart();
+  return low;
 }
 
-int verifiedTime(int time) {
-  if (time > 1439) {
-    return 1439 - time;
+int nextDueSmart(int& event, int& trigger, int current_time) {
+  bool trigger_due = trigger < smart_trigger_count && smart_trigger_array[trigger].minute == current_time;
+  if (trigger_due && (event >= smart_event_count || smart_trigger_array[trigger].index < smart_event_array[event])) {
+    return smart_trigger_array[trigger++].index;
   }
-  return time;
+  if (event < smart_event_count) {
+    return smart_event_array[event++];
+  }
+  return -1;
+}
+
+void setSmartLeadTime(int index, uint32_t lead_u_time) {
+  Smart& smart = smart_array[index];
+  String lead = "e(" + String(lead_u_time) + ")";
+  if (smart.lead_start > -1) {
+    int lead_end = smart.smart_string.indexOf(')', smart.lead_start) + 1;
+    smart.smart_string = smart.smart_string.substring(0, smart.lead_start) + lead + smart.smart_string.substring(lead_end);
+  } else {
+    smart.lead_start = smart.smart_string.length();
+    smart.smart_string += lead;
+  }
+  smart.lead_u_time = lead_u_time;
+  smart.state_changed = true;
 }
 
 void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_changed ; 1 switch_1 ; 2 switch_2 ; 5 stepper_movement ; 6 temperature_changed
@@ -928,7 +2097,7 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
   }
 
   int current_time = -1;
-  DateTime now = rtc.now();
+  DateTime now = RTCnow();
   current_time = (now.hour() * 60) + now.minute();
 
   if (current_time == -1) {
@@ -936,6 +2105,9 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
   }
 
   int i = -1;
+  int event = 0;
+  int trigger_index = findSmartTrigger(current_time);
+  uint8_t today = 1 << now.dayOfTheWeek();
   bool result = false;
   bool local_result;
   bool some_activation;
@@ -956,18 +2128,24 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
   #endif
   #ifdef thermostat
     bool at_thermostat_result;
+    int16_t fixed_temperature = toFixedPoint(temperature);
+    int16_t fixed_hysteresis = toFixedPoint(hysteresis);
+    bool rising;
+    bool falling;
     int new_heating = -1;
-    int new_heating_temperature = -1;
+    float new_heating_temperature = -1.0;
   #endif
   #ifdef chain
     bool at_chain_result;
     int new_destination = -1;
   #endif
-  String action;
-  String log_text = "";
-  String local_log = "";
-  while (++i < smart_count) {
-    if (smart_array[i].enabled && strContains(smart_array[i].days, days_of_the_week[now.dayOfTheWeek()])) {
+  SmartAction action;
+  String log_text;
+  String local_log;
+  log_text.reserve(96);
+  local_log.reserve(64);
+  while ((i = nextDueSmart(event, trigger_index, current_time)) > -1) {
+    if (smart_array[i].days & today) {
       local_result = false;
       some_activation = false;
       at_time_result = false;
@@ -989,7 +2167,7 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
       #ifdef chain
         at_chain_result = false;
       #endif
-      action = "?";
+      action = no_action;
       local_log = "";
 
       if (smart_array[i].at_time > -1) {
@@ -1032,11 +2210,13 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
       if (smart_array[i].at_dusk > -1) {
         if (smart_array[i].dusk_day > -1 && smart_array[i].dusk_day != now.day() && (smart_array[i].at_dusk == 0 ? !sensor_twilight : smart_array[i].at_dusk < light_sensor)) {
           smart_array[i].dusk_day = 0;
+          smart_array[i].state_changed = true;
         }
         at_dusk_result = trigger == 0 && (smart_array[i].at_dusk == 0 ? (twilight_change ? sensor_twilight : false) : smart_array[i].at_dusk > light_sensor);
         at_dusk_result &= smart_array[i].dusk_day == -1 || smart_array[i].dusk_day == 0;
         if (at_dusk_result && (smart_array[i].dusk_day == -1 || smart_array[i].dusk_day == 0)) {
           smart_array[i].local_dusk_time = current_time;
+          smart_array[i].state_changed = true;
           if (smart_array[i].dusk_day == 0) {
             smart_array[i].dusk_day = now.day();
           }
@@ -1057,12 +2237,14 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
       if (smart_array[i].at_dawn > -1) {
         if (smart_array[i].dawn_day > -1 && smart_array[i].dawn_day != now.day() && (smart_array[i].at_dawn == 0 ? sensor_twilight : smart_array[i].at_dawn > light_sensor)) {
           smart_array[i].dawn_day = 0;
+          smart_array[i].state_changed = true;
         }
         at_dawn_result = trigger == 0 && (smart_array[i].at_dawn == 0 ? (twilight_change ? !sensor_twilight : false) : smart_array[i].at_dawn < light_sensor);
         at_dawn_result &= smart_array[i].dawn_day == -1 || smart_array[i].dawn_day == 0;
         at_dawn_result &= !(smart_array[i].has_lowering_at_sunset_offset || calendar_twilight);
         if (at_dawn_result && (smart_array[i].dawn_day == -1 || smart_array[i].dawn_day == 0)) {
           smart_array[i].local_dawn_time = current_time;
+          smart_array[i].state_changed = true;
           if (smart_array[i].dawn_day == 0) {
             smart_array[i].dawn_day = now.day();
           }
@@ -1083,6 +2265,7 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
 
       if (smart_array[i].has_lowering_at_sunset_offset && calendar_twilight) {
         smart_array[i].has_lowering_at_sunset_offset = false;
+        smart_array[i].state_changed = true;
       }
 
       #ifdef light_switch
@@ -1105,6 +2288,7 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
           if (at_switch_result && smart_array[i].switch_offset > 0 && smart_array[i].switch_offset_countdown == -1) {
             at_switch_result = false;
             smart_array[i].switch_offset_countdown = smart_array[i].switch_offset * 60;
+            smart_array[i].state_changed = true;
           }
           some_activation |= at_switch_result;
           if (smart_array[i].switch_offset_countdown > -1) {
@@ -1142,6 +2326,7 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
           if (at_blinds_result && smart_array[i].blinds_offset > 0 && smart_array[i].blinds_offset_countdown == -1) {
             at_blinds_result = false;
             smart_array[i].blinds_offset_countdown = smart_array[i].blinds_offset * 60;
+            smart_array[i].state_changed = true;
           }
           some_activation |= at_blinds_result;
           if (smart_array[i].blinds_offset_countdown > -1) {
@@ -1214,12 +2399,30 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
       #endif
 
       #ifdef thermostat
-        if (smart_array[i].at_thermostat != "?") {
-          at_thermostat_result = trigger == 6 || smart_array[i].thermostat_offset_countdown == 0;
-          at_thermostat_result &= temperature == smart_array[i].at_thermostat.toFloat();
+        if (smart_array[i].at_thermostat != no_setpoint) {
+          if (trigger == 6) {
+            rising = (smart_array[i].thermostat_armed & rising_armed) && fixed_temperature >= smart_array[i].at_thermostat + fixed_hysteresis;
+            falling = (smart_array[i].thermostat_armed & falling_armed) && fixed_temperature <= smart_array[i].at_thermostat - fixed_hysteresis;
+            smart_array[i].thermostat_armed &= ~crossing_unknown;
+            if (rising) {
+              smart_array[i].thermostat_armed &= ~rising_armed;
+            }
+            if (falling) {
+              smart_array[i].thermostat_armed &= ~falling_armed;
+            }
+            if (fixed_temperature < smart_array[i].at_thermostat) {
+              smart_array[i].thermostat_armed |= rising_armed;
+            }
+            if (fixed_temperature > smart_array[i].at_thermostat) {
+              smart_array[i].thermostat_armed |= falling_armed;
+            }
+            at_thermostat_result = (rising && smart_array[i].thermostat_direction >= 0) || (falling && smart_array[i].thermostat_direction <= 0);
+          }
+          at_thermostat_result |= smart_array[i].thermostat_offset_countdown == 0;
           if (at_thermostat_result && smart_array[i].thermostat_offset > 0 && smart_array[i].thermostat_offset_countdown == -1) {
             at_thermostat_result = false;
             smart_array[i].thermostat_offset_countdown = smart_array[i].thermostat_offset * 60;
+            smart_array[i].state_changed = true;
           }
           some_activation |= at_thermostat_result;
           if (smart_array[i].thermostat_offset_countdown > -1) {
@@ -1228,19 +2431,14 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
           local_result |= at_thermostat_result;
         }
 
-        if (smart_array[i].must_be_ != "?") {
-          if (strContains(smart_array[i].must_be_, ".")) {
-            if (strContains(smart_array[i].must_be_, "<") || strContains(smart_array[i].must_be_, ">")) {
-              if (strContains(smart_array[i].must_be_, "<")) {
-                local_result &= temperature < smart_array[i].must_be_.substring(1).toFloat();
-              } else {
-                local_result &= temperature > smart_array[i].must_be_.substring(1).toFloat();
-              }
-            } else {
-              local_result &= temperature == smart_array[i].must_be_.toFloat();
-            }
+        if (smart_array[i].must_be.condition != no_condition) {
+          int16_t value = smart_array[i].must_be.target == temperature_target ? fixed_temperature : heating;
+          if (smart_array[i].must_be.condition == less_condition) {
+            local_result &= value < smart_array[i].must_be.operand;
+          } else if (smart_array[i].must_be.condition == greater_condition) {
+            local_result &= value > smart_array[i].must_be.operand;
           } else {
-            local_result &= heating == strContains(smart_array[i].must_be_, "1");
+            local_result &= value == smart_array[i].must_be.operand;
           }
         }
       #endif
@@ -1252,6 +2450,7 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
           if (at_chain_result && smart_array[i].chain_offset > 0 && smart_array[i].chain_offset_countdown == -1) {
             at_chain_result = false;
             smart_array[i].chain_offset_countdown = smart_array[i].chain_offset * 60;
+            smart_array[i].state_changed = true;
           }
           some_activation |= at_chain_result;
           if (smart_array[i].chain_offset_countdown > -1) {
@@ -1274,19 +2473,19 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
         }
       #endif
 
-      if (smart_array[i].twilight_must_be_ != "?") {
+      if (smart_array[i].twilight_must_be > 0) {
         if (next_sunset > -1 && next_sunrise > -1) {
-          if (strContains(smart_array[i].twilight_must_be_, "n")) {
+          if (smart_array[i].twilight_must_be & after_sunset) {
             local_result &= calendar_twilight;
           }
-          if (strContains(smart_array[i].twilight_must_be_, "d")) {
+          if (smart_array[i].twilight_must_be & after_sunrise) {
             local_result &= !calendar_twilight;
           }
         }
-        if (strContains(smart_array[i].twilight_must_be_, "<")) {
+        if (smart_array[i].twilight_must_be & after_dusk) {
           local_result &= sensor_twilight;
         }
-        if (strContains(smart_array[i].twilight_must_be_, ">")) {
+        if (smart_array[i].twilight_must_be & after_dawn) {
           local_result &= !sensor_twilight;
         }
       }
@@ -1309,7 +2508,7 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
         local_result &= !smart_array[i].any_trigger_required || (smart_array[i].at_blinds == "?" || (smart_array[i].at_blinds != "?" && at_blinds_result));
       #endif
       #ifdef thermostat
-        local_result &= !smart_array[i].any_trigger_required || (smart_array[i].at_thermostat == "?" || (smart_array[i].at_thermostat != "?" && at_thermostat_result));
+        local_result &= !smart_array[i].any_trigger_required || (smart_array[i].at_thermostat == no_setpoint || (smart_array[i].at_thermostat != no_setpoint && at_thermostat_result));
       #endif
       #ifdef chain
         local_result &= !smart_array[i].any_trigger_required || (smart_array[i].at_chain == "?" || (smart_array[i].at_chain != "?" && at_chain_result));
@@ -1317,7 +2516,7 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
 
       if (local_result) {
         if (at_sunset_result) {
-          action = smart_array[i].action == "?" || strContains(smart_array[i].action, ".") ? "100" : smart_array[i].action;
+          action = smart_array[i].action == value_action ? value_action : on_action;
           if (local_log.length() > 2) {
             local_log += " & ";
           }
@@ -1330,7 +2529,7 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
           }
         }
         if (at_sunrise_result) {
-          action = smart_array[i].action == "?" || strContains(smart_array[i].action, ".") ? "0" : smart_array[i].action;
+          action = smart_array[i].action == value_action ? value_action : off_action;
           if (local_log.length() > 2) {
             local_log += " & ";
           }
@@ -1343,7 +2542,7 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
           }
         }
         if (at_dusk_result) {
-          action = smart_array[i].action == "?" || strContains(smart_array[i].action, ".") ? "100" : smart_array[i].action;
+          action = smart_array[i].action == value_action ? value_action : on_action;
           if (local_log.length() > 2) {
             local_log += " & ";
           }
@@ -1353,7 +2552,7 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
           }
         }
         if (at_dawn_result) {
-          action = smart_array[i].action == "?" || strContains(smart_array[i].action, ".") ? "0" : smart_array[i].action;
+          action = smart_array[i].action == value_action ? value_action : off_action;
           if (local_log.length() > 2) {
             local_log += " & ";
           }
@@ -1363,7 +2562,7 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
           }
         }
         if (at_time_result) {
-          action = smart_array[i].action == "?" || strContains(smart_array[i].action, ".") ? "100" : smart_array[i].action;
+          action = smart_array[i].action == value_action ? value_action : on_action;
           if (local_log.length() > 2) {
             local_log += " & ";
           }
@@ -1405,7 +2604,7 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
             if (smart_array[i].thermostat_offset > 0) {
               local_log += "+" + String(smart_array[i].thermostat_offset);
             }
-            local_log += " " + smart_array[i].at_thermostat + "°C";
+            local_log += String(smart_array[i].thermostat_direction > 0 ? " >" : (smart_array[i].thermostat_direction < 0 ? " <" : " ")) + String(fromFixedPoint(smart_array[i].at_thermostat)) + "°C";
           }
         #endif
         #ifdef chain
@@ -1434,35 +2633,46 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
             action = smart_array[i].action;
           }
         }
-        if (smart_array[i].must_be_ != "?") {
-          local_log += ", must_be_";
-          local_log += smart_array[i].must_be_;
-        }
+        #ifdef thermostat
+          if (smart_array[i].must_be.condition != no_condition) {
+            local_log += ", must_be_";
+            local_log += getSmartMustBe(i);
+          }
+        #else
+          if (smart_array[i].must_be_ != "?") {
+            local_log += ", must_be_";
+            local_log += smart_array[i].must_be_;
+          }
+        #endif
         if (trigger > -1) {
           local_log += " (trigger: " + String(trigger) + ")";
         }
 
-        if (action != "?") {
+        if (action != no_action) {
           local_log = (smart_array[i].any_trigger_required ? " after " : " at ") + local_log;
-          if (strContains(action, ".") && strContains(action, ";") && action.indexOf(".") < action.indexOf(";")) {
-            putOfflineData(action.substring(0, action.indexOf(";")), "{\"val\":\"" + action.substring(action.indexOf(";") + 1) + "\"}");
-            log_text = "Action " + action + local_log;
+          if (action == remote_action) {
+            String action_text = getSmartAction(i);
+            putOfflineData(action_text.substring(0, action_text.indexOf(";")), "{\"val\":\"" + action_text.substring(action_text.indexOf(";") + 1) + "\"}");
+            log_text = "Action " + action_text + local_log;
           } else {
+            #if defined(light_switch) || defined(blinds) || defined(chain)
+              String action_text = action == on_action ? "100" : (action == off_action ? "0" : getSmartAction(i));
+            #endif
             #ifdef light_switch
               if (strContains(smart_array[i].what, 1) || smart_array[i].what == "?") {
-                if (strContains(action, -1) || action == "0") {
+                if (strContains(action_text, -1) || action_text == "0") {
                   new_light[0] = 0;
                 } else {
-                  if (strContains(action, 1)) {
+                  if (strContains(action_text, 1)) {
                     new_light[0] = 1;
                   }
                 }
               }
               if (strContains(smart_array[i].what, 2) || smart_array[i].what == "?") {
-                if (strContains(action, -2) || action == "0") {
+                if (strContains(action_text, -2) || action_text == "0") {
                   new_light[1] = 0;
                 } else {
-                  if (strContains(action, 2) || action == "1" || action == "100") {
+                  if (strContains(action_text, 2) || action_text == "1" || action_text == "100") {
                     new_light[1] = 1;
                   }
                 }
@@ -1472,112 +2682,80 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
                 if (smart_array[i].what != "?") {
                   log_text = smart_array[i].what + " to ";
                 }
-                log_text += (smart_array[i].action != "?" ? action : (strContains(action, 1) ? "On" : "Off")) + local_log;
+                log_text += (smart_array[i].action != no_action ? action_text : (strContains(action_text, 1) ? "On" : "Off")) + local_log;
                 result |= true;
-                smart_array[i].lead_u_time = now.unixtime() - offset - (dst ? 3600 : 0);
-                if (strContains(smart_array[i].smart_string, "e(")) {
-                  smart_array[i].smart_string.replace(
-                    smart_array[i].smart_string.substring(smart_array[i].smart_string.indexOf("e(") + 2, smart_array[i].smart_string.indexOf(")", smart_array[i].smart_string.indexOf("e("))),
-                    String(smart_array[i].lead_u_time)
-                  );
-                } else {
-                  smart_array[i].smart_string += "e(" + String(smart_array[i].lead_u_time) + ")";
-                }
+                setSmartLeadTime(i, now.unixtime() - offset - (dst ? 3600 : 0));
               }
             #endif
             #ifdef blinds
-              if (strContains(action, ";")) {
-                new_destination[0] = toSteps(action.substring(0, action.indexOf(";")).toInt(), steps[0]);
-                new_destination[1] = toSteps(action.substring(action.indexOf(";") + 1, action.lastIndexOf(";")).toInt(), steps[1]);
-                new_destination[2] = toSteps(action.substring(action.lastIndexOf(";") + 1).toInt(), steps[2]);
+              if (strContains(action_text, ";")) {
+                new_destination[0] = toSteps(action_text.substring(0, action_text.indexOf(";")).toInt(), steps[0]);
+                new_destination[1] = toSteps(action_text.substring(action_text.indexOf(";") + 1, action_text.lastIndexOf(";")).toInt(), steps[1]);
+                new_destination[2] = toSteps(action_text.substring(action_text.lastIndexOf(";") + 1).toInt(), steps[2]);
               } else {
                 if ((strContains(smart_array[i].what, 1) || smart_array[i].what == "?") && steps[0] > 0) {
-                    new_destination[0] = toSteps(action.toInt(), steps[0]);
+                    new_destination[0] = toSteps(action_text.toInt(), steps[0]);
                 }
                 if ((strContains(smart_array[i].what, 2) || smart_array[i].what == "?") && steps[1] > 0) {
-                  new_destination[1] = toSteps(action.toInt(), steps[1]);
+                  new_destination[1] = toSteps(action_text.toInt(), steps[1]);
                 }
                 if ((strContains(smart_array[i].what, 3) || smart_array[i].what == "?") && steps[2] > 0) {
-                  new_destination[2] = toSteps(action.toInt(), steps[2]);
+                  new_destination[2] = toSteps(action_text.toInt(), steps[2]);
                 }
               }
               if (((new_destination[0] > -1 && destination[0] != new_destination[0])
               || (new_destination[1] > -1 && destination[1] != new_destination[1])
               || (new_destination[2] > -1 && destination[2] != new_destination[2])) && !smart_lock) {
-                if (smart_array[i].action != "?") {
-                  if (strContains(action, ";")) {
-                    log_text = action + local_log;
+                if (smart_array[i].action != no_action) {
+                  if (strContains(action_text, ";")) {
+                    log_text = action_text + local_log;
                   } else {
                     if (smart_array[i].what != "?") {
                       log_text = smart_array[i].what + " ";
                     }
-                    log_text += action + "%" + local_log;
+                    log_text += action_text + "%" + local_log;
                   }
                 } else {
                   if (smart_array[i].what != "?") {
                     log_text = smart_array[i].what + " ";
                   }
-                  log_text += (action == "100" ? "Lowering" : "Lifting") + local_log;
+                  log_text += (action_text == "100" ? "Lowering" : "Lifting") + local_log;
                 }
                 result |= true;
                 if (at_sunset_result && !calendar_twilight) {
                   smart_array[i].has_lowering_at_sunset_offset = true;
                 }
-                smart_array[i].lead_u_time = now.unixtime() - offset - (dst ? 3600 : 0);
-                if (strContains(smart_array[i].smart_string, "e(")) {
-                  smart_array[i].smart_string.replace(
-                    smart_array[i].smart_string.substring(smart_array[i].smart_string.indexOf("e(") + 2, smart_array[i].smart_string.indexOf(")", smart_array[i].smart_string.indexOf("e("))),
-                    String(smart_array[i].lead_u_time)
-                  );
-                } else {
-                  smart_array[i].smart_string += "e(" + String(smart_array[i].lead_u_time) + ")";
-                }
+                setSmartLeadTime(i, now.unixtime() - offset - (dst ? 3600 : 0));
               }
             #endif
             #ifdef thermostat
-              if (strContains(action, ".")) {
+              if (action == decimal_action) {
                 new_heating = 1;
-                new_heating_temperature = action.toFloat();
+                new_heating_temperature = fromFixedPoint(smart_array[i].action_value);
               } else {
-                new_heating = strContains(action, 1) ? 1 : 0;
-                new_heating_temperature = 0;
+                new_heating = action == on_action || (action == value_action && smart_array[i].action_value == 1) ? 1 : 0;
+                new_heating_temperature = 0.0;
               }
               if (new_heating != heating && !smart_lock) {
-                log_text = (strContains(action, ".") ? ("Up to " + action + "°C") : String("Heating ") + (strContains(action, "1") ? "on" : "off")) + local_log;
+                log_text = (action == decimal_action ? ("Up to " + getSmartAction(i) + "°C") : String("Heating ") + (new_heating ? "on" : "off")) + local_log;
                 result |= true;
                 smart_heating = i;
-                smart_array[i].lead_u_time = now.unixtime() - offset - (dst ? 3600 : 0);
-                if (strContains(smart_array[i].smart_string, "e(")) {
-                  smart_array[i].smart_string.replace(
-                    smart_array[i].smart_string.substring(smart_array[i].smart_string.indexOf("e(") + 2, smart_array[i].smart_string.indexOf(")", smart_array[i].smart_string.indexOf("e("))),
-                    String(smart_array[i].lead_u_time)
-                  );
-                } else {
-                  smart_array[i].smart_string += "e(" + String(smart_array[i].lead_u_time) + ")";
-                }
+                setSmartLeadTime(i, now.unixtime() - offset - (dst ? 3600 : 0));
               }
             #endif
             #ifdef chain
-              new_destination = toSteps(action.toInt(), steps);
+              new_destination = toSteps(action_text.toInt(), steps);
               if (new_destination > -1 && destination != new_destination && !smart_lock) {
-                if (smart_array[i].action != "?") {
-                  log_text = action + "%" + local_log;
+                if (smart_array[i].action != no_action) {
+                  log_text = action_text + "%" + local_log;
                 } else {
-                  log_text = (action == "100" ? "Opening" : "Closing") + local_log;
+                  log_text = (action_text == "100" ? "Opening" : "Closing") + local_log;
                 }
                 result |= true;
                 if (at_sunset_result && !calendar_twilight) {
                   smart_array[i].has_lowering_at_sunset_offset = true;
                 }
-                smart_array[i].lead_u_time = now.unixtime() - offset - (dst ? 3600 : 0);
-                if (strContains(smart_array[i].smart_string, "e(")) {
-                  smart_array[i].smart_string.replace(
-                    smart_array[i].smart_string.substring(smart_array[i].smart_string.indexOf("e(") + 2, smart_array[i].smart_string.indexOf(")", smart_array[i].smart_string.indexOf("e("))),
-                    String(smart_array[i].lead_u_time)
-                  );
-                } else {
-                  smart_array[i].smart_string += "e(" + String(smart_array[i].lead_u_time) + ")";
-                }
+                setSmartLeadTime(i, now.unixtime() - offset - (dst ? 3600 : 0));
               }
             #endif
           }
@@ -1596,9 +2774,9 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
         if (new_light[1] > -1) {
           light[1] = strContains(new_light[1], 1);
         }
-        note(log_text);
+        noteInfo(log_text);
         setLights("smart");
-        writeObjectToFile("smart", getSmartJson(true));
+        journalSmart();
       }
     #endif
     #ifdef blinds
@@ -1610,9 +2788,9 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
             destination[j] = new_destination[j];
           }
         }
-        note(log_text);
+        noteInfo(log_text);
         prepareRotation("smart");
-        writeObjectToFile("smart", getSmartJson(true));
+        journalSmart();
       }
     #endif
     #ifdef thermostat
@@ -1624,9 +2802,9 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
           if (new_heating_temperature > -1) {
             heating_temperature = new_heating_temperature;
           }
-          note(log_text);
+          noteInfo(log_text);
           setHeating(heating, "smart");
-          writeObjectToFile("smart", getSmartJson(true));
+          journalSmart();
         }
       }
       if (!heating) {
@@ -1638,9 +2816,9 @@ void smartAction(int trigger, bool twilight_change) { // -1 none ; 0 light_chang
         if (new_destination > -1 && steps > 0) {
           destination = new_destination;
         }
-        note(log_text);
+        noteInfo(log_text);
         prepareRotation("smart");
-        writeObjectToFile("smart", getSmartJson(true));
+        journalSmart();
       }
     #endif
   }
@@ -1692,7 +2870,7 @@ void connectingToWifi(bool use_wps) {
   } else {
     log_text += " timed out";
   }
-  note(log_text);
+  noteInfo(log_text);
 
   if (result) {
     startServices();
@@ -1733,7 +2911,7 @@ void initiatingWPS() {
   } else {
     log_text += " timed out";
   }
-  note(log_text);
+  noteInfo(log_text);
 
   if (result) {
     saveSettings();
@@ -1745,14 +2923,20 @@ void initiatingWPS() {
 
 
 void activationTheLog() {
+  if (server.hasArg("level")) {
+    log_threshold = min(max((int)server.arg("level").toInt(), log_error), log_trace);
+    saveSettings(false);
+    server.send(200, "text/plain", "The log level is " + String(log_threshold));
+    return;
+  }
+
   if (keep_log) {
     server.send(200, "text/plain", "Done");
     return;
   }
 
-  File file = LittleFS.open("/log.txt", "a");
+  File file = LittleFS.open(getLogSegment(log_segment), "a");
   if (file) {
-    file.println();
     file.close();
   }
   last_accessed_log = 0;
@@ -1768,9 +2952,7 @@ void deactivationTheLog() {
     return;
   }
 
-  if (LittleFS.exists("/log.txt")) {
-    LittleFS.remove("/log.txt");
-  }
+  removeLog();
   last_accessed_log = 0;
   saveSettings(false);
   keep_log = false;
@@ -1779,39 +2961,126 @@ void deactivationTheLog() {
 }
 
 void requestForLogs() {
-  File file = LittleFS.open("/log.txt", "r");
+  sendLog(server.arg("from").toInt(), 0);
+}
+
+void requestForLogTail() { // "since" is UTC, log entries carry the local time of the RTC.
+  uint32_t since = server.arg("since").toInt();
+  sendLog(0, since > 0 ? since + offset + (dst ? 3600 : 0) : 0);
+}
+
+void sendLog(uint32_t from, uint32_t since) {
+  flushLog(true);
+
+  File file = LittleFS.open(getLogSegment(log_segment), "r");
   if (!file) {
     server.send(404, "text/plain", "No log file");
     return;
   }
 
-  server.setContentLength(file.size() + String("Log file\nHTTP/1.1 200 OK").length());
-  server.send(200, "text/plain", "Log file\n");
-  while (file.available()) {
-    server.sendContent(String(char(file.read())));
-  }
+  uint32_t end = ((uint32_t)log_segment << 16) + file.size();
   file.close();
 
+  int segment = oldestLogSegment();
+  uint32_t position = 0;
+  if (from <= end && (int)(from >> 16) >= segment) {
+    segment = from >> 16;
+    position = from & 0xFFFF;
+  }
+
+  uint8_t *block = new uint8_t[log_buffer_size + 1];
+  String chunk = from > 0 || since > 0 ? "" : "Log file\n";
+
+  server.sendHeader("Log-Offset", String(end));
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "text/plain", "");
+  for (; segment <= log_segment; segment++) {
+    if (since > 0 && segment < log_segment) {
+      uint32_t next_u_time = getLogSegmentTime(segment + 1);
+      if (next_u_time > 0 && next_u_time <= since) {
+        continue;
+      }
+    }
+
+    file = LittleFS.open(getLogSegment(segment), "r");
+    if (file) {
+      file.seek(position);
+      sendLogSegment(file, since, block, chunk);
+      file.close();
+    }
+    position = 0;
+  }
+  server.sendContent(chunk);
+  server.sendContent("");
+  delete[] block;
+
   last_accessed_log = 0;
   saveSettings(false);
+}
+
+void sendLogSegment(File& file, uint32_t since, uint8_t* block, String& chunk) {
+  LogRecord record;
+  size_t length = 0;
+  size_t position, text_end;
+  uint8_t next;
+
+  do {
+    length += file.read(block + length, log_buffer_size - length);
+    position = 0;
+    while (position + sizeof(LogRecord) <= length) {
+      memcpy(&record, block + position, sizeof(LogRecord));
+      text_end = position + sizeof(LogRecord) + record.length;
+      if (text_end > length) {
+        break;
+      }
+      if (since == 0 || (!(record.flags & log_uptime_flag) && record.u_time > since)) {
+        next = block[text_end];
+        block[text_end] = 0;
+        if (record.flags & log_session_flag) {
+          chunk += "\n";
+        }
+        chunk += getLogTime(record);
+        chunk += (const char*)block + position + sizeof(LogRecord);
+        chunk += "\r\n";
+        block[text_end] = next;
+        if (chunk.length() >= log_flush_threshold) {
+          server.sendContent(chunk);
+          chunk = "";
+        }
+      }
+      position = text_end;
+    }
+    memmove(block, block + position, length - position);
+    length -= position;
+  } while (position > 0);
+}
+
+uint32_t getLogSegmentTime(int segment) {
+  LogRecord record;
+  File file = LittleFS.open(getLogSegment(segment), "r");
+  if (!file) {
+    return 0;
+  }
 
-  server.send(200, "text/plain", "Done");
+  bool result = file.read((uint8_t*)&record, sizeof(LogRecord)) == sizeof(LogRecord) && !(record.flags & log_uptime_flag);
+  file.close();
+
+  return result ? record.u_time : 0;
 }
 
 void clearTheLog() {
-  File file = LittleFS.open("/log.txt", "w");
+  removeLog();
+
+  File file = LittleFS.open(getLogSegment(log_segment), "w");
   if (!file) {
     server.send(404, "text/plain", "Failed!");
     return;
   }
-
-  file.println();
   file.close();
 
   server.send(200, "text/plain", "The log file was cleared");
 }
 
-
 void getSunriseSunset(DateTime now) {
   if (geo_location.length() < 2) {
     return;
@@ -1822,7 +3091,8 @@ void getSunriseSunset(DateTime now) {
   next_sunset = sun.calcSunset() + (offset > 0 ? offset / 60 : 0) + (dst ? 60 : 0);
   next_sunrise = sun.calcSunrise() + (offset > 0 ? offset / 60 : 0) + (dst ? 60 : 0);
   last_sun_check = now.day();
-  note("Sunrise: " + String(next_sunrise) + " / Sunset: " + String(next_sunset));
+  setSmartIndex();
+  noteInfo("Sunrise: " + String(next_sunrise) + " / Sunset: " + String(next_sunset));
   if (calendar_twilight != !(next_sunrise < (now.hour() * 60) + now.minute() && (now.hour() * 60) + now.minute() < next_sunset)) {
     calendar_twilight = !calendar_twilight;
     saveSettings();
@@ -1832,17 +3102,105 @@ void getSunriseSunset(DateTime now) {
 int findMDNSDevices() {
   int n = MDNS.queryService("idom", "tcp");
 
-  if (n > 0) {
-    delete [] devices_array;
-    devices_array = new Device[n];
-    devices_count = n;
+  for (int i = 0; i < n; ++i) {
+    registerDevice(MDNS.IP(i).toString(), "");
+  }
+
+  return n;
+}
+
+void receivedMDNSDevice(MDNSResponder::MDNSServiceInfo service_info, MDNSResponder::AnswerType answer_type, bool set_content) {
+  String service = service_info.serviceDomain();
+
+  if (!set_content) {
+    for (int i = devices_count - 1; i >= 0; i--) {
+      if (service.length() > 0 && devices_array[i].service == service) {
+        removeDevice(i);
+      }
+    }
+    return;
+  }
+
+  if (answer_type != MDNSResponder::AnswerType::IP4Address) {
+    return;
+  }
 
-    for (int i = 0; i < n; ++i) {
-      devices_array[i].ip = String(MDNS.IP(i)[0]) + '.' + String(MDNS.IP(i)[1]) + '.' + String(MDNS.IP(i)[2]) + '.' + String(MDNS.IP(i)[3]);
+  int index;
+  for (IPAddress ip : service_info.IP4Adresses()) {
+    index = registerDevice(ip.toString(), "");
+    if (index > -1) {
+      devices_array[index].service = service;
     }
   }
+}
 
-  return n;
+int findDevice(const String& ip) {
+  for (int i = 0; i < devices_count; i++) {
+    if (devices_array[i].ip == ip) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int registerDevice(const String& ip, const String& mac) {
+  if (ip.length() < 7 || ip == WiFi.localIP().toString()) {
+    return -1;
+  }
+
+  int index = findDevice(ip);
+  if (index < 0) {
+    if (devices_count < max_devices) {
+      index = devices_count++;
+    } else {
+      index = 0;
+      for (int i = 1; i < devices_count; i++) {
+        if (millis() - devices_array[i].seen_millis > millis() - devices_array[index].seen_millis) {
+          index = i;
+        }
+      }
+    }
+    devices_array[index].ip = ip;
+    devices_array[index].mac = "";
+    devices_array[index].service = "";
+    devices_array[index].failed_millis = 0;
+    devices_array[index].multicast = false;
+    devices_array[index].multicast_seq = 0;
+  }
+
+  if (mac.length() > 0) {
+    devices_array[index].mac = mac;
+  }
+  devices_array[index].seen_millis = millis();
+  return index;
+}
+
+void removeDevice(int index) {
+  devices_count--;
+  for (int i = index; i < devices_count; i++) {
+    devices_array[i] = devices_array[i + 1];
+  }
+}
+
+int getDevices() {
+  bool expired = devices_count == 0;
+  for (int i = 0; i < devices_count && !expired; i++) {
+    expired = millis() - devices_array[i].seen_millis > device_ttl;
+  }
+
+  if (expired && (!devices_queried || millis() - devices_query_millis > device_query_interval)) {
+    devices_queried = true;
+    devices_query_millis = millis();
+    findMDNSDevices();
+  }
+
+  for (int i = devices_count - 1; i >= 0; i--) {
+    if (millis() - devices_array[i].seen_millis > device_ttl) {
+      removeDevice(i);
+    }
+  }
+
+  return devices_count;
 }
 
 void receivedOfflineData() {
@@ -1860,21 +3218,7 @@ void putOfflineData(String url, String data) {
     return;
   }
 
-  if (wifiClient.available() == 0) {
-    wifiClient.stop();
-  }
-
-  httpClient.begin(wifiClient, "http://" + url + "/set");
-  httpClient.addHeader("Content-Type", "text/plain");
-  int http_code = httpClient.PUT(data);
-
-  if (http_code == HTTP_CODE_OK) {
-    note("Data transfer to:\n " + url + ": " + data);
-  } else {
-    note("Data transfer to:\n " + url + " - error "  + http_code);
-  }
-
-  httpClient.end();
+  queueOfflineData(url, data, true, false);
 }
 
 void putMultiOfflineData(String data) {
@@ -1886,88 +3230,259 @@ void putMultiOfflineData(String data, bool log) {
     return;
   }
 
-  int count = findMDNSDevices();
-  if (count == 0) {
-    return;
-  }
-
-  int http_code;
-  String log_text = "";
+  #ifdef telemetry
+    sendTelemetry(data);
+  #endif
 
+  int count = getDevices();
   for (int i = 0; i < count; i++) {
-    if (wifiClient.available() == 0) {
-      wifiClient.stop();
+    if (devices_array[i].multicast) {
+      continue;
+    }
+    if (devices_array[i].failed_millis == 0 || millis() - devices_array[i].failed_millis > device_backoff) {
+      queueOfflineData(devices_array[i].ip, data, log, false);
     }
+  }
+}
 
-    httpClient.begin(wifiClient, "http://" + devices_array[i].ip + "/set");
-    httpClient.addHeader("Content-Type", "text/plain");
-    http_code = httpClient.PUT(data);
+void queueOfflineData(const String& ip, const String& data, bool log, bool query) {
+  if (dispatch_count == max_dispatches) {
+    dispatch_drops++;
+    noteWarn("Data transfer to:\n " + dispatch_array[dispatch_first].ip + " - dropped");
+    dispatch_first = (dispatch_first + 1) % max_dispatches;
+    dispatch_count--;
+  }
 
-    if (log) {
-      if (http_code == HTTP_CODE_OK) {
-        log_text += "\n " + devices_array[i].ip;
-      } else {
-        log_text += "\n " + devices_array[i].ip + " - error "  + http_code;
-      }
+  Dispatch& dispatch = dispatch_array[(dispatch_first + dispatch_count) % max_dispatches];
+  dispatch.ip = ip;
+  dispatch.data = data;
+  dispatch.log = log;
+  dispatch.query = query;
+  dispatch_count++;
+}
+
+void dispatchOfflineData() {
+  for (int i = 0; i < max_transfers; i++) {
+    if (transfers_array[i].busy) {
+      pollTransfer(transfers_array[i]);
     }
+  }
 
-    httpClient.end();
+  if (dispatch_count == 0 || WiFi.status() != WL_CONNECTED) {
+    return;
   }
 
-  if (log) {
-    note(data + " transfer to " + String(count) + ":" + log_text);
+  for (int i = 0; i < max_transfers; i++) {
+    if (!transfers_array[i].busy) { // One connect started per call, pollTransfer() waits for it without blocking.
+      Dispatch& dispatch = dispatch_array[dispatch_first];
+      startTransfer(transfers_array[i], dispatch);
+      dispatch.ip = "";
+      dispatch.data = "";
+      dispatch_first = (dispatch_first + 1) % max_dispatches;
+      dispatch_count--;
+      return;
+    }
   }
 }
 
-void getOfflineData() {
-  if (WiFi.status() != WL_CONNECTED) {
+void startTransfer(Transfer& transfer, const Dispatch& dispatch) {
+  transfer.dispatch = dispatch;
+  transfer.response = "";
+  transfer.sent_millis = millis();
+  transfer.connecting = true;
+  transfer.busy = true;
+
+  String host = dispatch.ip;
+  uint16_t port = 80;
+  if (host.indexOf(":") > -1) {
+    port = host.substring(host.indexOf(":") + 1).toInt();
+    host = host.substring(0, host.indexOf(":"));
+  }
+
+  IPAddress ip;
+  transfer.pcb = ip.fromString(host) ? tcp_new() : nullptr;
+  if (transfer.pcb == nullptr) {
+    finishTransfer(transfer, HTTPC_ERROR_CONNECTION_FAILED);
     return;
   }
+  tcp_arg(transfer.pcb, &transfer);
+  tcp_err(transfer.pcb, transferError);
+  if (tcp_connect(transfer.pcb, ip, port, nullptr) != ERR_OK) {
+    finishTransfer(transfer, HTTPC_ERROR_CONNECTION_FAILED);
+  }
+}
 
-  int count = findMDNSDevices();
-  if (count == 0) {
+void transferError(void* arg, err_t) { // lwIP has already freed the pcb.
+  ((Transfer*)arg)->pcb = nullptr;
+}
+
+void pollTransfer(Transfer& transfer) {
+  if (transfer.connecting) {
+    if (transfer.pcb != nullptr && transfer.pcb->state == ESTABLISHED) {
+      transfer.client = TransferClient(transfer.pcb);
+      transfer.pcb = nullptr;
+      transfer.connecting = false;
+
+      String host = transfer.dispatch.ip;
+      if (host.indexOf(":") > -1) {
+        host = host.substring(0, host.indexOf(":"));
+      }
+      String request = String(transfer.dispatch.query ? "POST /basicdata" : "PUT /set") + " HTTP/1.1\r\nHost: " + host
+      + "\r\nContent-Type: text/plain\r\nContent-Length: " + String(transfer.dispatch.data.length()) + "\r\nConnection: close\r\n\r\n" + transfer.dispatch.data;
+      transfer.client.setNoDelay(true);
+      transfer.client.write((const uint8_t*)request.c_str(), request.length());
+      transfer.sent_millis = millis();
+    } else if (transfer.pcb == nullptr || millis() - transfer.sent_millis > transfer_connect_timeout) {
+      finishTransfer(transfer, HTTPC_ERROR_CONNECTION_FAILED);
+    }
     return;
   }
 
-  int http_code;
-  String data;
-  String log_text = "";
+  char block[128];
+  int length;
+  while ((length = transfer.client.read((uint8_t*)block, min(transfer.client.available(), (int)sizeof(block)))) > 0) {
+    if (transfer.response.length() + length <= transfer_response_size) {
+      transfer.response.concat(block, length);
+    }
+  }
 
-  for (int i = 0; i < count; i++) {
-    if (wifiClient.available() == 0) {
-      wifiClient.stop();
+  if (transfer.client.connected()) {
+    if (millis() - transfer.sent_millis > transfer_timeout) {
+      finishTransfer(transfer, HTTPC_ERROR_READ_TIMEOUT);
     }
+    return;
+  }
+
+  finishTransfer(transfer, transfer.response.startsWith("HTTP/1.") ? transfer.response.substring(9, 12).toInt() : (int)HTTPC_ERROR_CONNECTION_LOST);
+}
 
-    httpClient.begin(wifiClient, "http://" + devices_array[i].ip + "/basicdata");
-    httpClient.addHeader("Content-Type", "text/plain");
-    http_code = httpClient.POST("");
+void finishTransfer(Transfer& transfer, int http_code) {
+  Dispatch& dispatch = transfer.dispatch;
+  if (transfer.pcb != nullptr) {
+    tcp_abort(transfer.pcb);
+    transfer.pcb = nullptr;
+  }
+  transfer.client.stop();
+  transfer.connecting = false;
+  transfer.busy = false;
 
+  int index = findDevice(dispatch.ip);
+  if (index > -1) {
     if (http_code == HTTP_CODE_OK) {
-      if (httpClient.getSize() > 15) {
-        data = httpClient.getString();
-        log_text +=  "\n " + devices_array[i].ip + ": ";
-        if (strContains(data, "ip")) {
-          log_text += "{*," + data.substring(data.indexOf("\"offset"));
-        } else {
-          log_text += data;
-        }
-        readData(data, true);
+      devices_array[index].seen_millis = millis();
+      devices_array[index].failed_millis = 0;
+    } else {
+      devices_array[index].failed_millis = max(millis(), 1UL);
+    }
+  }
+
+  if (dispatch.query) {
+    String data = http_code == HTTP_CODE_OK ? transfer.response.substring(transfer.response.indexOf("\r\n\r\n") + 4) : "";
+    if (data.length() > 15) {
+      if (dispatch.log) {
+        noteInfo("Received data...\n " + dispatch.ip + ": " + (strContains(data, "ip") ? "{*," + data.substring(data.indexOf("\"offset")) : data));
       }
+      readData(data, true);
+    } else if (dispatch.log && http_code != HTTP_CODE_OK) {
+      noteWarn("Received data...\n " + dispatch.ip + ": error " + http_code);
+    }
+  } else if (dispatch.log) {
+    if (http_code == HTTP_CODE_OK) {
+      noteInfo("Data transfer to:\n " + dispatch.ip + ": " + dispatch.data);
     } else {
-      log_text += "\n " + devices_array[i].ip + ": error " + http_code;
+      noteWarn("Data transfer to:\n " + dispatch.ip + " - error " + http_code);
+    }
+  }
+
+  dispatch.ip = "";
+  dispatch.data = "";
+  transfer.response = "";
+}
+
+#ifdef telemetry
+void setupTelemetry() {
+  telemetryUdp.beginMulticast(WiFi.localIP(), telemetry_group, telemetry_port);
+}
+
+void sendTelemetry(const String& data) {
+  if (!data.startsWith("{") || data.length() > telemetry_size - 64) {
+    return;
+  }
+
+  String datagram = "{\"seq\":" + String(++telemetry_seq) + ",\"ip\":\"" + WiFi.localIP().toString() + "\",\"id\":\"" + WiFi.macAddress() + "\"";
+  datagram += data.length() > 2 ? "," + data.substring(1) : "}";
+
+  telemetryUdp.beginPacketMulticast(telemetry_group, telemetry_port, WiFi.localIP());
+  telemetryUdp.write((const uint8_t*)datagram.c_str(), datagram.length());
+  telemetryUdp.endPacket();
+}
+
+void receiveTelemetry() {
+  int size = telemetryUdp.parsePacket();
+  if (size <= 0) {
+    return;
+  }
+
+  String ip = telemetryUdp.remoteIP().toString();
+  int index = findDevice(ip);
+  if (size >= telemetry_size || index < 0) {
+    return;
+  }
+
+  char datagram[telemetry_size];
+  int length = telemetryUdp.read(datagram, size);
+  datagram[max(length, 0)] = 0;
+
+  DynamicJsonDocument json_object(telemetry_size);
+  if (deserializeJson(json_object, datagram) || !json_object["seq"].is<uint32_t>() || json_object["ip"].as<String>() != ip
+  || devices_array[index].mac.length() == 0 || json_object["id"].as<String>() != devices_array[index].mac) { // The mac is only learned from /basicdata.
+    noteDebug("Telemetry rejected from " + ip + ": " + String(datagram));
+    return;
+  }
+
+  uint32_t seq = json_object["seq"].as<uint32_t>();
+  if (devices_array[index].multicast_seq > 0 && seq > devices_array[index].multicast_seq + 1) {
+    telemetry_lost += seq - devices_array[index].multicast_seq - 1;
+  }
+  devices_array[index].multicast_seq = seq;
+  devices_array[index].seen_millis = millis();
+
+  DynamicJsonDocument data(telemetry_size);
+  for (const char* key : telemetry_keys) {
+    if (json_object.containsKey(key)) {
+      data[key] = json_object[key];
     }
+  }
+  if (data.size() > 0) {
+    String payload;
+    serializeJson(data, payload);
+    readData(payload, true);
+  }
+}
+#endif
 
-    httpClient.end();
+void getOfflineData() {
+  if (WiFi.status() != WL_CONNECTED) {
+    return;
   }
 
-  note("Received data..." + log_text);
+  int count = getDevices();
+  for (int i = 0; i < count; i++) {
+    queueOfflineData(devices_array[i].ip, "", true, true);
+  }
 }
 
 void setupOTA() {
   ArduinoOTA.setHostname(host_name);
 
+  ArduinoOTA.onStart([]() {
+    flushSettings(true);
+    flushLog(true);
+  });
+
   ArduinoOTA.onEnd([]() {
-    note("Software update over Wi-Fi");
+    noteInfo(F("Software update over Wi-Fi"));
+    flushLog(true);
   });
 
   ArduinoOTA.onError([](ota_error_t error) {
@@ -1983,20 +3498,16 @@ void setupOTA() {
     } else if (error == OTA_END_ERROR) {
       log_text += "End";
     }
-    note(log_text + String(" failed!"));
+    noteError(log_text + String(" failed!"));
   });
 
   ArduinoOTA.begin();
 }
 
 void getSmartDetail() {
-  String result;
-  serializeJson(getSmartJson(false), result);
-  server.send(200, "text/plain", result);
+  sendSmartJson(false);
 }
 
 void getRawSmartDetail() {
-  String result;
-  serializeJson(getSmartJson(true), result);
-  server.send(200, "text/plain", result);
+  sendSmartJson(true);
 }
@@ -7,13 +7,13 @@ void setup() {
   LittleFS.begin();
   Wire.begin();
 
-  keep_log = LittleFS.exists("/log.txt");
+  setupLog();
 
   #ifdef physical_clock
     rtc.begin();
-    note("iDom Thermostat " + String(version) + "." + String(core_version));
+    noteInfo("iDom Thermostat " + String(version) + "." + String(core_version));
   #else
-    note("iDom Thermostat " + String(version) + "." + String(core_version) + "wo");
+    noteInfo("iDom Thermostat " + String(version) + "." + String(core_version) + "wo");
   #endif
 
   sprintf(host_name, "therm_%s", String(WiFi.macAddress()).c_str());
@@ -35,12 +35,13 @@ void setup() {
   };
 
   if (RTCisrunning()) {
-    start_u_time = rtc.now().unixtime() - offset - (dst ? 3600 : 0);
+    start_u_time = RTCnow().unixtime() - offset - (dst ? 3600 : 0);
   }
 
   powerButton.setSingleClickCallback(&powerButtonSingle, (void*)"");
   powerButton.setLongPressCallback(&powerButtonLong, (void*)"");
 
+  WiFi.setSleepMode(WIFI_LIGHT_SLEEP);
   setupOTA();
   connectingToWifi(false);
 }
@@ -57,16 +58,30 @@ void loop() {
   }
 
   powerButton.poll();
+  flushSettings(false);
+  flushLog(false);
+  dispatchOfflineData();
+  #ifdef telemetry
+    receiveTelemetry();
+  #endif
+
+  uint32_t tick_millis = millis();
+  if ((int32_t)(tick_millis - next_tick_millis) < 0) {
+    delay(min(next_tick_millis - tick_millis, (uint32_t)idle_slice));
+    return;
+  }
 
+  uint32_t previous_u_time = loop_u_time;
   if (hasTimeChanged()) {
+    int elapsed = previous_u_time > 0 && loop_u_time > previous_u_time ? loop_u_time - previous_u_time : 1;
     if (downtime > 0) {
-      downtime--;
+      downtime = max(downtime - elapsed, 0);
     }
 
     if (heating) {
       if (heating_time > 0) {
         saveTheState();
-        if ((RTCisrunning() ? (heating_time - rtc.now().unixtime()) : heating_time--) <= 0) {
+        if ((RTCisrunning() ? (int)(heating_time - RTCnow().unixtime()) : heating_time--) <= 0) {
           automaticHeatingOff();
         }
       }
@@ -75,38 +90,112 @@ void loop() {
       }
     }
     automation();
+
+    next_tick_millis = tick_millis + secondsToNextTick() * 1000;
+  } else {
+    next_tick_millis = tick_millis + idle_slice;
   }
 }
 
 
 bool readSettings(bool backup) {
-  File file = LittleFS.open(backup ? "/backup.txt" : "/settings.txt", "r");
-  if (!file) {
-    note("The " + String(backup ? "backup" : "settings") + " file cannot be read");
+  String path = backup ? "/settings.bin.bak" : "/settings.bin";
+  if (!LittleFS.exists(path) && !LittleFS.exists(path + ".tmp") && !LittleFS.exists(path + ".bak")) {
+    return importSettings(backup);
+  }
+
+  size_t length;
+  uint8_t* content = readCheckedFile(path, length);
+  size_t record_size = content != 0 && content[0] == 1 ? settings_v1_size : sizeof(SettingsRecord);
+  if (content == 0 || length < record_size) {
+    noteWarn("The " + String(backup ? "backup" : "settings") + " file cannot be read");
+    delete [] content;
+    return false;
+  }
+
+  SettingsRecord record = {};
+  record.log_threshold = log_info;
+  memcpy(&record, content, record_size);
+  if ((record.schema != settings_schema && record.schema != 1) || length != record_size + record.smart_length) {
+    noteError(String(backup ? "Backup" : "Settings") + " error: schema " + String(record.schema));
+    delete [] content;
+    return false;
+  }
+
+  String smart_string = (const char*)content + record_size;
+  delete [] content;
+
+  noteInfo("Reading the " + String(backup ? "backup" : "settings") + " file");
+
+  record.ssid[sizeof(record.ssid) - 1] = '\0';
+  record.password[sizeof(record.password) - 1] = '\0';
+  record.location[sizeof(record.location) - 1] = '\0';
+
+  last_accessed_log = record.last_accessed_log;
+  ssid = record.ssid;
+  password = record.password;
+  uprisings = record.uprisings + 1;
+  offset = record.offset;
+  dst = record.flags & dst_flag;
+  setSmart(smart_string);
+  smart_lock = record.flags & smart_lock_flag;
+  geo_location = record.location;
+  if (geo_location.length() > 2) {
+    sun.setPosition(geo_location.substring(0, geo_location.indexOf("x")).toDouble(), geo_location.substring(geo_location.indexOf("x") + 1).toDouble(), 0);
+  }
+  sunset_u_time = record.sunset_u_time;
+  sunrise_u_time = record.sunrise_u_time;
+  sensor_twilight = record.flags & sensor_twilight_flag;
+  calendar_twilight = record.flags & calendar_twilight_flag;
+  correction = record.correction;
+  minimum_temperature = record.minimum_temperature;
+  hysteresis = record.hysteresis;
+  heating_temperature_plus = record.heating_temperature_plus;
+  heating_time_plus = record.heating_time_plus;
+  downtime_plus = record.downtime_plus;
+  vacation = record.vacation;
+  key_lock = record.flags & key_lock_flag;
+  log_threshold = min(max((int)record.log_threshold, log_error), log_trace);
+
+  saveSettings(false);
+  flushSettings(true); // Written at once, so the uprisings count survives a reset within settings_delay.
+
+  return true;
+}
+
+bool importSettings(bool backup) {
+  String content = readCheckedFile(backup ? (LittleFS.exists("/settings.tmp") ? "/settings.tmp" : "/backup.txt") : "/settings.txt");
+  if (content.length() == 0) {
+    noteWarn("The " + String(backup ? "backup" : "settings") + " file cannot be read");
     return false;
   }
 
   DynamicJsonDocument json_object(1024);
-  DeserializationError deserialization_error = deserializeJson(json_object, file);
+  DeserializationError deserialization_error = deserializeJson(json_object, content);
 
   if (deserialization_error) {
-    note(String(backup ? "Backup" : "Settings") + " error: " + String(deserialization_error.f_str()));
-    file.close();
+    noteError(String(backup ? "Backup" : "Settings") + " error: " + String(deserialization_error.f_str()));
     return false;
   }
 
-  file.seek(0);
-  note("Reading the " + String(backup ? "backup" : "settings") + " file:\n " + file.readString());
-  file.close();
+  noteInfo("Reading the " + String(backup ? "backup" : "settings") + " file:\n " + content);
 
   if (json_object.containsKey("log")) {
     last_accessed_log = json_object["log"].as<int>();
   }
   if (json_object.containsKey("ssid")) {
-    ssid = json_object["ssid"].as<String>();
+    if (json_object["ssid"].as<String>().length() < sizeof(SettingsRecord::ssid)) {
+      ssid = json_object["ssid"].as<String>();
+    } else {
+      noteWarn(F("The SSID is too long"));
+    }
   }
   if (json_object.containsKey("password")) {
-    password = json_object["password"].as<String>();
+    if (json_object["password"].as<String>().length() < sizeof(SettingsRecord::password)) {
+      password = json_object["password"].as<String>();
+    } else {
+      noteWarn(F("The password is too long"));
+    }
   }
   if (json_object.containsKey("uprisings")) {
     uprisings = json_object["uprisings"].as<int>() + 1;
@@ -123,7 +212,9 @@ bool readSettings(bool backup) {
     }
   }
   smart_lock = json_object.containsKey("smart_lock");
-  if (json_object.containsKey("location")) {
+  if (json_object.containsKey("location") && json_object["location"].as<String>().length() >= sizeof(SettingsRecord::location)) {
+    noteWarn("The location is too long: " + json_object["location"].as<String>());
+  } else if (json_object.containsKey("location")) {
     geo_location = json_object["location"].as<String>();
     if (geo_location.length() > 2) {
       sun.setPosition(geo_location.substring(0, geo_location.indexOf("x")).toDouble(), geo_location.substring(geo_location.indexOf("x") + 1).toDouble(), 0);
@@ -143,6 +234,9 @@ bool readSettings(bool backup) {
   if (json_object.containsKey("minimum")) {
     minimum_temperature = json_object["minimum"].as<float>();
   }
+  if (json_object.containsKey("hysteresis")) {
+    hysteresis = json_object["hysteresis"].as<float>();
+  }
   if (json_object.containsKey("plustemp")) {
     heating_temperature_plus = json_object["plustemp"].as<float>();
   }
@@ -156,8 +250,12 @@ bool readSettings(bool backup) {
     vacation = json_object["vacation"].as<uint32_t>();
   }
   key_lock = json_object.containsKey("key_lock");
+  if (json_object.containsKey("log_level")) {
+    log_threshold = min(max(json_object["log_level"].as<int>(), log_error), log_trace);
+  }
 
   saveSettings(false);
+  flushSettings(true); // Written at once, so the uprisings count survives a reset within settings_delay.
 
   return true;
 }
@@ -167,6 +265,73 @@ void saveSettings() {
 }
 
 void saveSettings(bool log) {
+  if (settings_dirty) {
+    avoided_settings_writes++;
+  } else {
+    settings_dirty = true;
+    settings_dirty_millis = millis();
+  }
+  settings_log |= log;
+}
+
+void flushSettings(bool force) {
+  if (!settings_dirty || (!force && millis() - settings_dirty_millis < settings_delay)) {
+    return;
+  }
+
+  settings_dirty = false;
+  writeSettings(settings_log);
+  settings_log = false;
+}
+
+void writeSettings(bool log) {
+  SettingsRecord record = {};
+  String smart_string = getSmartString(true);
+
+  record.schema = settings_schema;
+  record.flags = (dst ? dst_flag : 0) | (smart_lock ? smart_lock_flag : 0) | (sensor_twilight ? sensor_twilight_flag : 0)
+  | (calendar_twilight ? calendar_twilight_flag : 0) | (key_lock ? key_lock_flag : 0);
+  record.smart_length = smart_string.length();
+  record.last_accessed_log = last_accessed_log;
+  record.uprisings = uprisings;
+  record.offset = offset;
+  record.sunset_u_time = sunset_u_time;
+  record.sunrise_u_time = sunrise_u_time;
+  record.correction = correction;
+  record.minimum_temperature = minimum_temperature;
+  record.hysteresis = hysteresis;
+  record.heating_temperature_plus = heating_temperature_plus;
+  record.heating_time_plus = heating_time_plus;
+  record.downtime_plus = downtime_plus;
+  record.vacation = vacation;
+  record.log_threshold = log_threshold;
+  strncpy(record.ssid, ssid.c_str(), sizeof(record.ssid) - 1);
+  strncpy(record.password, password.c_str(), sizeof(record.password) - 1);
+  strncpy(record.location, geo_location.c_str(), sizeof(record.location) - 1);
+
+  size_t length = sizeof(SettingsRecord) + record.smart_length;
+  uint8_t* content = new uint8_t[length];
+  memcpy(content, &record, sizeof(SettingsRecord));
+  memcpy(content + sizeof(SettingsRecord), smart_string.c_str(), record.smart_length);
+  bool result = writeCheckedFile("/settings.bin", content, length);
+  delete [] content;
+
+  if (result) {
+    if (log) {
+      noteInfo("Saving settings:\n " + exportSettings());
+    }
+    if (LittleFS.exists("/settings.txt")) {
+      LittleFS.remove("/settings.txt");
+    }
+    if (LittleFS.exists("/backup.txt")) {
+      LittleFS.remove("/backup.txt");
+    }
+  } else {
+    noteError(F("Saving the settings failed!"));
+  }
+}
+
+String exportSettings() {
   DynamicJsonDocument json_object(1024);
 
   json_object["ver"] = String(version) + "." + String(core_version);
@@ -213,6 +378,9 @@ void saveSettings(bool log) {
   if (minimum_temperature != default_minimum_temperature) {
     json_object["minimum"] = minimum_temperature;
   }
+  if (hysteresis != default_hysteresis) {
+    json_object["hysteresis"] = hysteresis;
+  }
   if (heating_temperature_plus != default_heating_temperature_plus) {
     json_object["plustemp"] = heating_temperature_plus;
   }
@@ -228,21 +396,48 @@ void saveSettings(bool log) {
   if (key_lock) {
     json_object["key_lock"] = key_lock;
   }
+  if (log_threshold != log_info) {
+    json_object["log_level"] = log_threshold;
+  }
 
-  if (writeObjectToFile("settings", json_object)) {
-    if (log) {
-      String log_text;
-      serializeJson(json_object, log_text);
-      note("Saving settings:\n " + log_text);
-    }
+  String content;
+  serializeJson(json_object, content);
+  return content;
+}
+
+bool resume() {
+  if (!readTheState()) {
+    return false;
+  }
 
-    writeObjectToFile("backup", json_object);
+  if (heating_time > 0 && getHeatingTime() > 4000 && !RTCisrunning()) {
+    heating_time = 0;
+  }
+
+  if (heating || heating_temperature > 0.0 || heating_time > 0) {
+    setHeating(true, "resume");
   } else {
-    note("Saving the settings failed!");
+    clearTheState();
+    return false;
   }
+
+  return true;
 }
 
-bool resume() {
+bool readTheState() {
+  #ifdef physical_clock
+    ResumeState state;
+    i2c_transactions++;
+    rtc.readnvram((uint8_t*)&state, sizeof(ResumeState), 0);
+    if (state.marker == resume_marker && RTCisrunning()) {
+      heating = state.heating;
+      heating_temperature = fromFixedPoint(state.heating_temperature);
+      heating_time = state.heating_time;
+      resume_state = state;
+      return true;
+    }
+  #endif
+
   File file = LittleFS.open("/resume.txt", "r");
   if (!file) {
     return false;
@@ -253,7 +448,7 @@ bool resume() {
   file.close();
 
   if (deserialization_error) {
-    note("Resume error: " + String(deserialization_error.c_str()));
+    noteWarn("Resume error: " + String(deserialization_error.c_str()));
     return false;
   }
 
@@ -263,24 +458,29 @@ bool resume() {
   }
   if (json_object.containsKey("htime")) {
     heating_time = json_object["htime"].as<int>();
-    if (getHeatingTime() > 4000 && !RTCisrunning()) {
-      heating_time = 0;
-    }
-  }
-
-  if (heating || heating_temperature > 0.0 || heating_time > 0) {
-    setHeating(true, "resume");
-  } else {
-    if (LittleFS.exists("/resume.txt")) {
-      LittleFS.remove("/resume.txt");
-    }
-    return false;
   }
 
   return true;
 }
 
 void saveTheState() {
+  ResumeState state = {resume_marker, heating, (int16_t)(heating_temperature > 0.0 ? toFixedPoint(heating_temperature) : 0), heating_time};
+  if (memcmp(&state, &resume_state, sizeof(ResumeState)) == 0) {
+    return;
+  }
+  resume_state = state;
+
+  #ifdef physical_clock
+    if (RTCisrunning()) {
+      i2c_transactions++;
+      rtc.writenvram(0, (uint8_t*)&state, sizeof(ResumeState));
+      if (LittleFS.exists("/resume.txt")) {
+        LittleFS.remove("/resume.txt");
+      }
+      return;
+    }
+  #endif
+
   StaticJsonDocument<100> json_object;
 
   if (heating) {
@@ -296,13 +496,24 @@ void saveTheState() {
   writeObjectToFile("resume", json_object);
 }
 
+void clearTheState() {
+  resume_state.marker = 0;
+  #ifdef physical_clock
+    i2c_transactions++;
+    rtc.writenvram(0, 0);
+  #endif
+  if (LittleFS.exists("/resume.txt")) {
+    LittleFS.remove("/resume.txt");
+  }
+}
+
 
 String getValue() {
   return String(heating);
 }
 
 int getHeatingTime() {
-  return heating_time > 0 ? (RTCisrunning() ? (heating_time - rtc.now().unixtime()) : heating_time) : 0;
+  return heating_time > 0 ? (RTCisrunning() ? (heating_time - RTCnow().unixtime()) : heating_time) : 0;
 }
 
 void startServices() {
@@ -310,7 +521,9 @@ void startServices() {
   server.on("/set", HTTP_PUT, receivedOfflineData);
   server.on("/state", HTTP_GET, requestForState);
   server.on("/basicdata", HTTP_POST, exchangeOfBasicData);
+  server.on("/schedule", HTTP_GET, requestForSchedule);
   server.on("/log", HTTP_GET, requestForLogs);
+  server.on("/log/tail", HTTP_GET, requestForLogTail);
   server.on("/log", HTTP_DELETE, clearTheLog);
   server.on("/test/smartdetail", HTTP_GET, getSmartDetail);
   server.on("/test/smartdetail/raw", HTTP_GET, getRawSmartDetail);
@@ -318,9 +531,17 @@ void startServices() {
   server.on("/admin/log", HTTP_DELETE, deactivationTheLog);
   server.begin();
 
-  note(String(host_name) + (MDNS.begin(host_name) ? " started" : " unsuccessful!"));
+  bool mdns = MDNS.begin(host_name);
+  noteInfo(String(host_name) + (mdns ? " started" : " unsuccessful!"));
 
   MDNS.addService("idom", "tcp", 8080);
+  if (devices_query) {
+    MDNS.removeServiceQuery(devices_query);
+  }
+  devices_query = MDNS.installServiceQuery("idom", "tcp", receivedMDNSDevice);
+  #ifdef telemetry
+    setupTelemetry();
+  #endif
 
   ntpClient.begin();
   ntpClient.update();
@@ -345,6 +566,17 @@ void handshake() {
     reply += ",\"active\":" + String(millis() / 1000);
   }
   reply += ",\"uprisings\":" + String(uprisings);
+  if (avoided_settings_writes > 0) {
+    reply += ",\"avoided_saves\":" + String(avoided_settings_writes);
+  }
+  if (dispatch_drops > 0) {
+    reply += ",\"dropped_transfers\":" + String(dispatch_drops);
+  }
+  #ifdef telemetry
+    if (telemetry_lost > 0) {
+      reply += ",\"udp_lost\":" + String(telemetry_lost);
+    }
+  #endif
   if (offset > 0) {
     reply += ",\"offset\":" + String(offset);
   }
@@ -354,8 +586,9 @@ void handshake() {
   if (RTCisrunning()) {
     #ifdef physical_clock
       reply += ",\"rtc\":true";
+      reply += ",\"i2c\":" + String(i2c_transactions);
     #endif
-    reply += ",\"time\":" + String(rtc.now().unixtime() - offset - (dst ? 3600 : 0));
+    reply += ",\"time\":" + String(RTCnow().unixtime() - offset - (dst ? 3600 : 0));
   }
   if (smart_count > 0) {
     reply += ",\"smart\":\"" + getSmartString(true) + "\"";
@@ -396,6 +629,9 @@ void handshake() {
   if (minimum_temperature != default_minimum_temperature) {
     reply += ",\"minimum\":" + String(minimum_temperature);
   }
+  if (hysteresis != default_hysteresis) {
+    reply += ",\"hysteresis\":" + String(hysteresis);
+  }
   if (heating_temperature_plus != default_heating_temperature_plus) {
     reply += ",\"plustemp\":" + String(heating_temperature_plus);
   }
@@ -452,13 +688,151 @@ void exchangeOfBasicData() {
   reply += ",\"offset\":" + String(offset) + ",\"dst\":" + String(dst);
 
   if (RTCisrunning()) {
-    reply += ",\"time\":" + String(rtc.now().unixtime() - offset - (dst ? 3600 : 0));
+    reply += ",\"time\":" + String(RTCnow().unixtime() - offset - (dst ? 3600 : 0));
   }
 
   if (temperature > -127.0) {
     reply +=  ",\"temp\":" + String(temperature);
   }
 
+  #ifdef telemetry
+    reply += ",\"multicast\":true";
+  #endif
+
+  server.send(200, "text/plain", "{" + reply + "}");
+}
+
+
+int compareScheduleEvents(const void* a, const void* b) {
+  const ScheduleEvent* first = (const ScheduleEvent*)a;
+  const ScheduleEvent* second = (const ScheduleEvent*)b;
+  if (first->minute != second->minute) {
+    return first->minute - second->minute;
+  }
+  return first->index - second->index;
+}
+
+void setSchedule() {
+  if (schedule_array != 0) {
+    delete [] schedule_array;
+    schedule_array = 0;
+  }
+  schedule_count = 0;
+
+  if (smart_count == 0) {
+    return;
+  }
+
+  ScheduleEvent *events = new ScheduleEvent[smart_count * 35];
+  int count = 0;
+
+  int minutes[5];
+  SmartAction actions[5];
+  int i = -1;
+  while (++i < smart_count) {
+    if (!smart_array[i].enabled || smart_array[i].at_dusk > -1 || smart_array[i].at_dawn > -1 || smart_array[i].at_thermostat != no_setpoint
+    || smart_array[i].must_be.condition != no_condition || smart_array[i].twilight_must_be > 0) {
+      continue;
+    }
+
+    minutes[0] = smart_array[i].at_time;
+    actions[0] = smart_array[i].action == value_action ? value_action : on_action;
+    minutes[1] = smart_array[i].at_sunset && next_sunset > -1 ? verifiedTime(next_sunset + smart_array[i].sunset_offset) : -1;
+    actions[1] = actions[0];
+    minutes[2] = smart_array[i].at_sunrise && next_sunrise > -1 ? verifiedTime(next_sunrise + smart_array[i].sunrise_offset) : -1;
+    actions[2] = smart_array[i].action == value_action ? value_action : off_action;
+    minutes[3] = smart_array[i].start_time > -1 ? smart_array[i].start_time : (smart_array[i].end_time > -1 ? 0 : -1);
+    actions[3] = smart_array[i].action;
+    minutes[4] = smart_array[i].end_time > -1 ? smart_array[i].end_time : (smart_array[i].start_time > -1 ? 1440 : -1);
+    if (minutes[4] > -1 && minutes[4] <= minutes[3]) {
+      minutes[4] += 1440; // A window past midnight ends on the next day.
+    }
+    actions[4] = actions[3] == no_action || actions[3] == remote_action ? actions[3] : off_action;
+    if (smart_array[i].any_trigger_required && (minutes[0] > -1) + (minutes[1] > -1) + (minutes[2] > -1) + (minutes[3] > -1) > 1) {
+      continue;
+    }
+
+    for (int j = 0; j < 5; j++) {
+      if (minutes[j] == -1 || actions[j] == no_action || actions[j] == remote_action) {
+        continue;
+      }
+      for (int day = 0; day < 7; day++) {
+        if (smart_array[i].days & (1 << day)) {
+          events[count].minute = (day * 1440 + minutes[j]) % 10080;
+          events[count].index = i;
+          events[count].heating = actions[j] == decimal_action || actions[j] == on_action || (actions[j] == value_action && smart_array[i].action_value == 1);
+          events[count].temperature = actions[j] == decimal_action ? smart_array[i].action_value : no_setpoint;
+          count++;
+        }
+      }
+    }
+  }
+
+  qsort(events, count, sizeof(ScheduleEvent), compareScheduleEvents);
+
+  int j = 0;
+  for (int k = 0; k < count; k++) {
+    if (j > 0 && events[j - 1].minute == events[k].minute) {
+      j--;
+    }
+    if (j > 0 && events[j - 1].heating == events[k].heating && events[j - 1].temperature == events[k].temperature) {
+      continue;
+    }
+    events[j++] = events[k];
+  }
+
+  if (j > 0) {
+    schedule_array = new ScheduleEvent[j];
+    memcpy(schedule_array, events, j * sizeof(ScheduleEvent));
+  }
+  schedule_count = j;
+  delete [] events;
+}
+
+int findScheduleEvent(int minute) {
+  int low = 0;
+  int high = schedule_count;
+  while (low < high) {
+    int middle = (low + high) / 2;
+    if (schedule_array[middle].minute <= minute) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low > 0 ? low - 1 : schedule_count - 1;
+}
+
+void requestForSchedule() {
+  String reply = "";
+
+  if (RTCisrunning()) {
+    DateTime now = RTCnow();
+    int minute = now.dayOfTheWeek() * 1440 + now.hour() * 60 + now.minute();
+    reply += "\"now\":" + String(minute);
+
+    if (schedule_count > 0) {
+      int k = findScheduleEvent(minute);
+      int end;
+      reply += ",\"schedule\":[";
+      for (int j = 0; j < schedule_count; j++) {
+        ScheduleEvent *event = &schedule_array[(k + j) % schedule_count];
+        if (j > 0) {
+          reply += ",";
+        }
+        reply += "{\"start\":" + String(event->minute);
+        end = schedule_array[(k + j + 1) % schedule_count].minute;
+        reply += ",\"end\":" + String(end > event->minute ? end : end + 10080);
+        reply += ",\"heating\":" + String(event->heating ? "true" : "false");
+        if (event->temperature != no_setpoint) {
+          reply += ",\"temp\":" + String(fromFixedPoint(event->temperature));
+        }
+        reply += ",\"smart\":" + String(event->index) + "}";
+      }
+      reply += "]";
+    }
+  }
+
   server.send(200, "text/plain", "{" + reply + "}");
 }
 
@@ -474,7 +848,7 @@ void powerButtonSingle(void* b) {
       downtime = downtime_plus;
     }
   } else {
-    heating_time = RTCisrunning() ? (rtc.now().unixtime() + heating_time_plus) : heating_time_plus;
+    heating_time = RTCisrunning() ? (RTCnow().unixtime() + heating_time_plus) : heating_time_plus;
     heating_temperature = 0.0;
     downtime = 0;
   }
@@ -492,7 +866,8 @@ void powerButtonLong(void* b) {
     heating_time = 0;
     heating_temperature = 0.0;
     if (smart_heating > -1) {
-      downtime = RTCisrunning() ? (86400 - (rtc.now().hour() * 3600) - rtc.now().minute() * 60) : 86400;
+      DateTime now = RTCnow();
+      downtime = RTCisrunning() ? (86400 - (now.hour() * 3600) - now.minute() * 60) : 86400;
     }
   } else {
     heating_time = 0;
@@ -505,11 +880,13 @@ void powerButtonLong(void* b) {
 }
 
 void readData(const String& payload, bool per_wifi) {
+  scheduleTick();
+
   DynamicJsonDocument json_object(1024);
   DeserializationError deserialization_error = deserializeJson(json_object, payload);
 
   if (deserialization_error) {
-    note("Read data error: " + String(deserialization_error.c_str()) + "\n" + payload);
+    noteWarn("Read data error: " + String(deserialization_error.c_str()) + "\n" + payload);
     return;
   }
 
@@ -517,18 +894,17 @@ void readData(const String& payload, bool per_wifi) {
   bool twilight_change = false;
 
   if (json_object.containsKey("ip") && json_object.containsKey("id")) {
-      for (int i = 0; i < devices_count; i++) {
-        if (devices_array[i].ip == json_object["ip"].as<String>()) {
-          devices_array[i].mac = json_object["id"].as<String>();
-        }
-      }
+    int index = registerDevice(json_object["ip"].as<String>(), json_object["id"].as<String>());
+    if (index > -1) {
+      devices_array[index].multicast = json_object.containsKey("multicast") && json_object["multicast"].as<bool>();
+    }
   }
 
   if (json_object.containsKey("offset")) {
     if (offset != json_object["offset"].as<int>()) {
       if (RTCisrunning() && !json_object.containsKey("time")) {
-        rtc.adjust(DateTime((rtc.now().unixtime() - offset) + json_object["offset"].as<int>()));
-        note("Time zone change");
+        adjustRTC(DateTime((RTCnow().unixtime() - offset) + json_object["offset"].as<int>()));
+        noteInfo(F("Time zone change"));
       }
       offset = json_object["offset"].as<int>();
       settings_change = true;
@@ -540,8 +916,8 @@ void readData(const String& payload, bool per_wifi) {
       dst = !dst;
       settings_change = true;
       if (RTCisrunning() && !json_object.containsKey("time")) {
-        rtc.adjust(DateTime(rtc.now().unixtime() + (dst ? 3600 : -3600)));
-        note(dst ? "Summer time" : "Winter time");
+        adjustRTC(DateTime(RTCnow().unixtime() + (dst ? 3600 : -3600)));
+        noteInfo(dst ? F("Summer time") : F("Winter time"));
       }
     }
   }
@@ -550,18 +926,14 @@ void readData(const String& payload, bool per_wifi) {
     int new_u_time = json_object["time"].as<int>() + offset + (dst ? 3600 : 0);
     if (new_u_time > 1546304461) {
       if (RTCisrunning()) {
-        if (abs(new_u_time - (int)rtc.now().unixtime()) > 60) {
-          rtc.adjust(DateTime(new_u_time));
-          note("Adjust time");
+        if (abs(new_u_time - (int)RTCnow().unixtime()) > 60) {
+          adjustRTC(DateTime(new_u_time));
+          noteInfo(F("Adjust time"));
         }
       } else {
-        #ifdef physical_clock
-          rtc.adjust(DateTime(new_u_time));
-        #else
-          rtc.begin(DateTime(new_u_time));
-        #endif
-        note("RTC begin");
-        start_u_time = (millis() / 1000) + rtc.now().unixtime() - offset - (dst ? 3600 : 0);
+        adjustRTC(DateTime(new_u_time));
+        noteInfo(F("RTC begin"));
+        start_u_time = (millis() / 1000) + RTCnow().unixtime() - offset - (dst ? 3600 : 0);
       }
     }
   }
@@ -589,7 +961,9 @@ void readData(const String& payload, bool per_wifi) {
   }
 
   if (json_object.containsKey("location")) {
-    if (geo_location != json_object["location"].as<String>()) {
+    if (json_object["location"].as<String>().length() >= sizeof(SettingsRecord::location)) {
+      noteWarn("The location is too long: " + json_object["location"].as<String>());
+    } else if (geo_location != json_object["location"].as<String>()) {
       geo_location = json_object["location"].as<String>();
       if (geo_location.length() > 2) {
         sun.setPosition(geo_location.substring(0, geo_location.indexOf("x")).toDouble(), geo_location.substring(geo_location.indexOf("x") + 1).toDouble(), 0);
@@ -620,6 +994,13 @@ void readData(const String& payload, bool per_wifi) {
     }
   }
 
+  if (json_object.containsKey("hysteresis")) {
+    if (hysteresis != json_object["hysteresis"].as<float>()) {
+      hysteresis = json_object["hysteresis"].as<float>();
+      settings_change = true;
+    }
+  }
+
   if (json_object.containsKey("plustemp")) {
     if (heating_temperature_plus != json_object["plustemp"].as<float>()) {
       heating_temperature_plus = json_object["plustemp"].as<float>();
@@ -654,7 +1035,8 @@ void readData(const String& payload, bool per_wifi) {
       twilight_change = true;
       settings_change = true;
       if (RTCisrunning()) {
-        int current_time = (rtc.now().hour() * 60) + rtc.now().minute();
+        DateTime now = RTCnow();
+        int current_time = (now.hour() * 60) + now.minute();
         if (sensor_twilight) {
           if (abs(current_time - dusk_time) > 60) {
             dusk_time = current_time;
@@ -676,7 +1058,7 @@ void readData(const String& payload, bool per_wifi) {
   if (json_object.containsKey("vacation")) {
     if (vacation != json_object["vacation"].as<uint32_t>()) {
       vacation = json_object["vacation"].as<uint32_t>() + offset + (dst ? 3600 : 0);
-      if (vacation > 0 && smart_heating > -1 && (RTCisrunning() && vacation < rtc.now().unixtime())) {
+      if (vacation > 0 && smart_heating > -1 && (RTCisrunning() && vacation < RTCnow().unixtime())) {
         heating_time = 0;
         heating_temperature = 0.0;
         downtime = 0;
@@ -700,7 +1082,7 @@ void readData(const String& payload, bool per_wifi) {
       setHeating(true, per_wifi ? (json_object.containsKey("apk") ? "apk" : "local") : "cloud");
     }
     if (strContains(newValue, "c")) {
-      heating_time = RTCisrunning() ? (rtc.now().unixtime() + newValue.substring(newValue.indexOf("c") + 1).toInt()) : newValue.substring(newValue.indexOf("c") + 1).toInt();
+      heating_time = RTCisrunning() ? (RTCnow().unixtime() + newValue.substring(newValue.indexOf("c") + 1).toInt()) : newValue.substring(newValue.indexOf("c") + 1).toInt();
       heating_temperature = 0.0;
       downtime = 0;
       smart_heating = -1;
@@ -720,27 +1102,30 @@ void readData(const String& payload, bool per_wifi) {
   }
 
   if (settings_change) {
-    note("Received the data:\n " + payload);
+    noteInfo("Received the data:\n " + payload);
     saveSettings();
   }
   if (json_object.containsKey("light")) {
     smartAction(0, twilight_change);
   }
   if (json_object.containsKey("location") && RTCisrunning()) {
-    getSunriseSunset(rtc.now());
+    getSunriseSunset(RTCnow());
   }
 }
 
 void automation() {
+  bool new_minute = (int32_t)(loop_u_time / 60) != processed_minute;
+  processed_minute = loop_u_time / 60;
+
   if (!RTCisrunning()) {
-    smartAction();
+    smartAction(new_minute);
     return;
   }
 
-  DateTime now = rtc.now();
+  DateTime now = RTCnow();
   int current_time = (now.hour() * 60) + now.minute();
 
-  if (now.second() == 0) {
+  if (new_minute) {
     if (current_time == 60) {
       ntpClient.update();
       readData("{\"time\":" + String(ntpClient.getEpochTime()) + "}", false);
@@ -752,19 +1137,19 @@ void automation() {
   }
 
   if (current_time == 120 || current_time == 180) {
-    if (now.month() == 3 && now.day() > 24 && days_of_the_week[now.dayOfTheWeek()][0] == 's' && current_time == 120 && !dst) {
+    if (now.month() == 3 && now.day() > 24 && days_of_the_week[now.dayOfTheWeek()] == 's' && current_time == 120 && !dst) {
       int new_u_time = now.unixtime() + 3600;
-      rtc.adjust(DateTime(new_u_time));
+      adjustRTC(DateTime(new_u_time));
       dst = true;
-      note("Setting summer time");
+      noteInfo(F("Setting summer time"));
       saveSettings();
       getSunriseSunset(now);
     }
-    if (now.month() == 10 && now.day() > 24 && days_of_the_week[now.dayOfTheWeek()][0] == 's' && current_time == 180 && dst) {
+    if (now.month() == 10 && now.day() > 24 && days_of_the_week[now.dayOfTheWeek()] == 's' && current_time == 180 && dst) {
       int new_u_time = now.unixtime() - 3600;
-      rtc.adjust(DateTime(new_u_time));
+      adjustRTC(DateTime(new_u_time));
       dst = false;
-      note("Setting winter time");
+      noteInfo(F("Setting winter time"));
       saveSettings();
       getSunriseSunset(now);
     }
@@ -776,7 +1161,7 @@ void automation() {
       saveSettings();
     }
   } else {
-    if (now.second() == 0 && ((current_time > 181 && last_sun_check != now.day()) || next_sunset == -1 || next_sunrise == -1)) {
+    if (new_minute && ((current_time > 181 && last_sun_check != now.day()) || next_sunset == -1 || next_sunrise == -1)) {
       getSunriseSunset(now);
     }
 
@@ -796,11 +1181,40 @@ void automation() {
     }
   }
 
-  smartAction();
+  smartAction(new_minute);
 }
 
-bool hasTheTemperatureChanged() {
-  if (loop_u_time % 60 != 0) {
+int secondsToNextTick() {
+  if (!RTCisrunning()) {
+    return 1;
+  }
+
+  int seconds = 60 - loop_u_time % 60;
+  if (downtime > 0) {
+    seconds = min(seconds, downtime);
+  }
+  if (heating && heating_time > 0) {
+    seconds = min(seconds, max(heating_time - (int)loop_u_time, 1));
+  }
+  if (vacation > loop_u_time) {
+    seconds = min(seconds, (int)(vacation - loop_u_time));
+  }
+  uint8_t today = 1 << DateTime(loop_u_time).dayOfTheWeek();
+  for (int i = 0; i < smart_count; i++) {
+    if (smart_array[i].thermostat_offset_countdown > -1 && (smart_array[i].days & today)) { // smartAction() counts down only on the rule's days.
+      return 1;
+    }
+  }
+
+  return seconds;
+}
+
+void scheduleTick() {
+  next_tick_millis = millis();
+}
+
+int hasTheTemperatureChanged(bool new_minute) {
+  if (!new_minute) {
     return -1;
   }
 
@@ -816,8 +1230,8 @@ bool hasTheTemperatureChanged() {
   return -1;
 }
 
-void smartAction() {
-  smartAction(hasTheTemperatureChanged(), false);
+void smartAction(bool new_minute) {
+  smartAction(hasTheTemperatureChanged(new_minute), false);
 }
 
 
@@ -830,19 +1244,19 @@ void automaticHeatingOff() {
 }
 
 void setHeating(bool set, String orderer) {
+  scheduleTick();
+
   if (heating != set) {
     heating = set;
     digitalWrite(relay_pin, set);
   }
 
-  note(orderer + " heating " + (set ? (heating_time == 0 && heating_temperature == 0.0 ? "on" : ((heating_time > 0 ? "on time " + String(getHeatingTime()) : "") + (heating_temperature > 0.0 ? "by temperature " + String(heating_temperature) : ""))) : "off"));
+  noteInfo(orderer + " heating " + (set ? (heating_time == 0 && heating_temperature == 0.0 ? "on" : ((heating_time > 0 ? "on time " + String(getHeatingTime()) : "") + (heating_temperature > 0.0 ? "by temperature " + String(heating_temperature) : ""))) : "off"));
 
   if (set) {
     saveTheState();
   } else {
-    if (LittleFS.exists("/resume.txt")) {
-      LittleFS.remove("/resume.txt");
-    }
+    clearTheState();
   }
 
   delay(500);
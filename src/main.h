@@ -7,6 +7,7 @@
 
 #define physical_clock
 #define thermostat
+#define telemetry
 
 const char device[7] = "therm";
 const char smart_prefix = 't';
@@ -41,6 +42,68 @@ const float default_heating_temperature_plus = 1.0;
 float heating_temperature_plus = default_heating_temperature_plus;
 const float default_correction = -3.5;
 float correction = default_correction;
+const float default_hysteresis = 0.25;
+float hysteresis = default_hysteresis;
+
+struct ScheduleEvent {
+  int16_t minute; // Minute of the week, Sunday 0:00 is 0.
+  int16_t index;
+  int16_t temperature; // no_setpoint when heating is not limited by temperature.
+  bool heating;
+};
+
+ScheduleEvent *schedule_array; // Setpoint changes derived from time-only rules, sorted by minute. Only /schedule reads it.
+int schedule_count = 0;
+
+struct ResumeState {
+  uint8_t marker;
+  uint8_t heating;
+  int16_t heating_temperature; // Hundredths of a degree.
+  int32_t heating_time;
+};
+
+const uint8_t resume_marker = 0xA5;
+ResumeState resume_state = {0, 0, 0, 0}; // Last state written to the NVRAM or /resume.txt.
+
+const uint8_t settings_schema = 2;
+const uint8_t dst_flag = 1;
+const uint8_t smart_lock_flag = 2;
+const uint8_t sensor_twilight_flag = 4;
+const uint8_t calendar_twilight_flag = 8;
+const uint8_t key_lock_flag = 16;
+
+struct SettingsRecord { // Layout of /settings.bin, followed by smart_length bytes of the smart string.
+  uint8_t schema;
+  uint8_t flags;
+  uint16_t smart_length;
+  int32_t last_accessed_log;
+  int32_t uprisings;
+  int32_t offset;
+  uint32_t sunset_u_time;
+  uint32_t sunrise_u_time;
+  float correction;
+  float minimum_temperature;
+  float hysteresis;
+  float heating_temperature_plus;
+  int32_t heating_time_plus;
+  int32_t downtime_plus;
+  uint32_t vacation;
+  char ssid[33];
+  char password[65];
+  char location[34];
+  uint8_t log_threshold;
+};
+
+const size_t settings_v1_size = (offsetof(SettingsRecord, log_threshold) + alignof(SettingsRecord) - 1) & ~(alignof(SettingsRecord) - 1); // Schema 1 ended before log_threshold.
+
+const int idle_slice = 20;
+const int settings_delay = 5000;
+bool settings_dirty = false;
+bool settings_log = false;
+uint32_t settings_dirty_millis = 0;
+uint32_t avoided_settings_writes = 0;
+uint32_t next_tick_millis = 0;
+int32_t processed_minute = -1; // loop_u_time / 60 of the last tick that did the once a minute work.
 
 int selector = 1;
 int selector_counter = 0;
@@ -126,10 +189,16 @@ void refreshTheDisplay();
 void displayText(String text, int line);
 void displayText(String text, int line, bool append);
 bool readSettings(bool backup);
+bool importSettings(bool backup);
+String exportSettings();
 void saveSettings();
 void saveSettings(bool log);
+void flushSettings(bool force);
+void writeSettings(bool log);
 bool resume();
+bool readTheState();
 void saveTheState();
+void clearTheState();
 String getValue();
 int getHeatingTime();
 String getThermostatDetail();
@@ -139,11 +208,16 @@ void startServices();
 void handshake();
 void requestForState();
 void exchangeOfBasicData();
+void setSchedule();
+int findScheduleEvent(int minute);
+void requestForSchedule();
 void powerButtonSingle(void* b);
 void powerButtonLong(void* b);
 void selectorButtonSingle(void* b);
 void readData(const String& payload, bool per_wifi);
 void automation();
-void smartAction();
+int secondsToNextTick();
+void scheduleTick();
+void smartAction(bool new_minute);
 void automaticHeatingOff();
 void setHeating(bool set, String orderer);
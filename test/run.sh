@@ -0,0 +1,21 @@
+#!/bin/sh
+# Builds and runs the host tests: test/run.sh [test_name ...]
+cd "$(dirname "$0")" || exit 1
+mkdir -p build
+
+tests="$*"
+if [ -z "$tests" ]; then
+  tests=$(ls test_*.cpp | sed 's/\.cpp$//')
+fi
+
+failed=0
+for name in $tests; do
+  if ! g++ -std=gnu++17 -O2 -w -Istubs -o "build/$name" "$name.cpp"; then
+    echo "$name: build failed"
+    failed=1
+    continue
+  fi
+  "./build/$name" || failed=1
+done
+
+exit $failed
@@ -0,0 +1,176 @@
+#pragma once
+// Minimal host stand-in for the ESP8266 Arduino core. Only what src/ uses is provided.
+#include <algorithm>
+#include <cmath>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+
+#define HEX 16
+#define DEC 10
+#define D5 14
+#define OUTPUT 1
+#define INPUT 0
+#define LOW 0
+#define HIGH 1
+#define PROGMEM
+#define PSTR(x) (x)
+#define F(x) (reinterpret_cast<const __FlashStringHelper*>(x))
+#define strlen_P strlen
+#define strcpy_P strcpy
+#define strncpy_P strncpy
+#define memcpy_P memcpy
+#define snprintf_P snprintf
+#define pgm_read_byte(x) (*(const uint8_t*)(x))
+#define digitalRead(x) 0
+
+typedef uint8_t byte;
+typedef const char* PGM_P;
+class __FlashStringHelper;
+
+using std::abs;
+using std::max;
+using std::min;
+
+inline unsigned long fake_millis = 0; // Advanced by delay() and by the tests.
+inline unsigned long millis() { return fake_millis; }
+inline unsigned long micros() { return fake_millis * 1000; }
+inline void delay(unsigned long ms) { fake_millis += ms; }
+inline void yield() {}
+inline void pinMode(int, int) {}
+inline void digitalWrite(int, int) {}
+inline bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+class String {
+ public:
+  std::string s;
+  String() {}
+  String(const char* c) : s(c ? c : "") {}
+  String(const std::string& x) : s(x) {}
+  String(const __FlashStringHelper* c) : s((const char*)c) {}
+  String(char c) : s(1, c) {}
+  String(int v) : s(std::to_string(v)) {}
+  String(unsigned v) : s(std::to_string(v)) {}
+  String(unsigned v, int base) { char b[16]; snprintf(b, 16, base == 16 ? "%x" : "%u", v); s = b; }
+  String(long v) : s(std::to_string(v)) {}
+  String(unsigned long v) : s(std::to_string(v)) {}
+  String(long long v) : s(std::to_string(v)) {}
+  String(unsigned long long v) : s(std::to_string(v)) {}
+  String(float v, unsigned char d = 2) { char b[32]; snprintf(b, 32, "%.*f", d, v); s = b; }
+  String(double v, unsigned char d = 2) { char b[32]; snprintf(b, 32, "%.*f", d, v); s = b; }
+  String(bool v) : s(v ? "1" : "0") {}
+  unsigned int length() const { return s.size(); }
+  char charAt(unsigned i) const { return i < s.size() ? s[i] : 0; }
+  char operator[](unsigned i) const { return charAt(i); }
+  char& operator[](unsigned i) { return s[i]; }
+  int indexOf(const String& v, unsigned from = 0) const { auto p = s.find(v.s, from); return p == std::string::npos ? -1 : (int)p; }
+  int indexOf(char v, unsigned from = 0) const { auto p = s.find(v, from); return p == std::string::npos ? -1 : (int)p; }
+  int indexOf(const char* v, unsigned from = 0) const { return indexOf(String(v), from); }
+  int lastIndexOf(const String& v) const { auto p = s.rfind(v.s); return p == std::string::npos ? -1 : (int)p; }
+  int lastIndexOf(char v) const { auto p = s.rfind(v); return p == std::string::npos ? -1 : (int)p; }
+  int lastIndexOf(const char* v) const { return lastIndexOf(String(v)); }
+  String substring(unsigned a) const { return a > s.size() ? String() : String(s.substr(a)); }
+  String substring(unsigned a, unsigned b) const { if (a > b) std::swap(a, b); if (a > s.size()) return String(); return String(s.substr(a, std::min<size_t>(b, s.size()) - a)); }
+  long toInt() const { return atol(s.c_str()); }
+  float toFloat() const { return atof(s.c_str()); }
+  double toDouble() const { return atof(s.c_str()); }
+  const char* c_str() const { return s.c_str(); }
+  void replace(const String& a, const String& b) { if (a.s.empty()) return; size_t p = 0; while ((p = s.find(a.s, p)) != std::string::npos) { s.replace(p, a.s.size(), b.s); p += b.s.size(); } }
+  bool reserve(unsigned n) { s.reserve(n); return true; }
+  bool concat(const String& x) { s += x.s; return true; }
+  bool concat(const char* x, unsigned n) { s.append(x, n); return true; }
+  bool startsWith(const String& x) const { return s.rfind(x.s, 0) == 0; }
+  bool endsWith(const String& x) const { return s.size() >= x.s.size() && s.compare(s.size() - x.s.size(), x.s.size(), x.s) == 0; }
+  void trim() { s.erase(0, s.find_first_not_of(" \t\r\n")); s.erase(s.find_last_not_of(" \t\r\n") + 1); }
+  void remove(unsigned i) { if (i < s.size()) s.erase(i); }
+  void remove(unsigned i, unsigned n) { if (i < s.size()) s.erase(i, n); }
+  void toLowerCase() { for (char& c : s) c = tolower(c); }
+  String& operator+=(const String& x) { s += x.s; return *this; }
+  String& operator+=(const char* x) { s += x; return *this; }
+  String& operator+=(char x) { s += x; return *this; }
+  String& operator+=(int x) { s += std::to_string(x); return *this; }
+  String& operator+=(unsigned x) { s += std::to_string(x); return *this; }
+  String& operator+=(long x) { s += std::to_string(x); return *this; }
+  String& operator+=(unsigned long x) { s += std::to_string(x); return *this; }
+  String& operator+=(float x) { return *this += String(x); }
+  String& operator+=(double x) { return *this += String(x); }
+  bool operator==(const String& x) const { return s == x.s; }
+  bool operator!=(const String& x) const { return s != x.s; }
+  bool operator==(const char* x) const { return s == x; }
+  bool operator!=(const char* x) const { return s != x; }
+  bool operator<(const String& x) const { return s < x.s; }
+  bool operator>(const String& x) const { return s > x.s; }
+  const char* begin() const { return s.data(); }
+  const char* end() const { return s.data() + s.size(); }
+};
+
+inline String operator+(const String& a, const String& b) { return String(a.s + b.s); }
+inline String operator+(const String& a, const char* b) { return String(a.s + b); }
+inline String operator+(const char* a, const String& b) { return String(a + b.s); }
+inline String operator+(const String& a, char b) { return String(a.s + b); }
+inline String operator+(const String& a, int b) { return a + String(b); }
+inline String operator+(const String& a, unsigned b) { return a + String(b); }
+inline String operator+(const String& a, long b) { return a + String(b); }
+inline String operator+(const String& a, unsigned long b) { return a + String(b); }
+inline String operator+(const String& a, float b) { return a + String(b); }
+inline String operator+(const String& a, double b) { return a + String(b); }
+
+class Print {
+ public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t) = 0;
+  virtual size_t write(const uint8_t* b, size_t n) { size_t r = 0; while (n--) r += write(*b++); return r; }
+  size_t write(const char* c) { return write((const uint8_t*)c, strlen(c)); }
+  size_t write(const char* c, size_t n) { return write((const uint8_t*)c, n); }
+  size_t print(const String& x) { return write(x.c_str()); }
+  size_t print(const char* x) { return write(x); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(int x) { return print(String(x)); }
+  size_t print(unsigned x) { return print(String(x)); }
+  size_t print(long x) { return print(String(x)); }
+  size_t print(unsigned long x) { return print(String(x)); }
+  size_t print(float x) { return print(String(x)); }
+  size_t print(const __FlashStringHelper* x) { return print((const char*)x); }
+  size_t println() { return write("\r\n"); }
+  size_t println(const String& x) { return print(x) + println(); }
+  size_t println(const char* x) { return print(x) + println(); }
+  size_t printf(const char*, ...) { return 0; }
+  virtual void flush() {}
+};
+
+class Stream : public Print {
+ public:
+  virtual int available() { return 0; }
+  virtual int read() { return -1; }
+  virtual int peek() { return -1; }
+  void setTimeout(unsigned long) {}
+  size_t readBytes(char* b, size_t n) { size_t i = 0; int c; while (i < n && (c = read()) >= 0) b[i++] = c; return i; }
+  size_t readBytes(uint8_t* b, size_t n) { return readBytes((char*)b, n); }
+  String readString() { String r; int c; while ((c = read()) >= 0) r += (char)c; return r; }
+  String readStringUntil(char t) { String r; int c; while ((c = read()) >= 0 && c != t) r += (char)c; return r; }
+};
+
+inline bool serial_echo = false; // Set by a test to see the device log on stdout.
+
+class HardwareSerial : public Stream {
+ public:
+  void begin(long) {}
+  size_t write(uint8_t c) override { if (serial_echo) putchar(c); return 1; }
+  using Print::write;
+  explicit operator bool() { return true; }
+};
+
+inline HardwareSerial Serial;
+
+struct EspClass {
+  void restart() {}
+  uint32_t getFreeHeap() { return 0; }
+  uint32_t getCycleCount() { return 0; }
+  void deepSleep(uint64_t) {}
+};
+
+inline EspClass ESP;
@@ -0,0 +1,238 @@
+#pragma once
+// A small ArduinoJson 6 work-alike: objects, strings, numbers and booleans, enough for src/.
+#include <Arduino.h>
+#include <map>
+#include <memory>
+#include <vector>
+
+struct JsonNode {
+  enum Kind { Null, Bool, Int, Float, Text, Object } kind = Null;
+  bool boolean = false;
+  long long integer = 0;
+  double real = 0;
+  std::string text;
+  std::vector<std::pair<std::string, std::shared_ptr<JsonNode>>> members;
+
+  std::shared_ptr<JsonNode> find(const std::string& key) const {
+    for (auto& member : members) if (member.first == key) return member.second;
+    return nullptr;
+  }
+};
+
+class JsonVariant {
+ public:
+  JsonVariant() : node(std::make_shared<JsonNode>()) {}
+  JsonVariant(std::shared_ptr<JsonNode> node) : node(node) {}
+
+  JsonVariant operator[](const String& key) { return JsonVariant(child(key.s)); }
+  JsonVariant operator[](const char* key) { return JsonVariant(child(key)); }
+  JsonVariant operator[](const String& key) const { auto found = node->find(key.s); return found ? JsonVariant(found) : JsonVariant(); }
+  JsonVariant operator[](const char* key) const { return (*this)[String(key)]; }
+  bool containsKey(const String& key) const { auto found = node->find(key.s); return found && found->kind != JsonNode::Null; }
+  bool containsKey(const char* key) const { return containsKey(String(key)); }
+  bool isNull() const { return node->kind == JsonNode::Null; }
+  size_t size() const { return node->members.size(); }
+  void clear() { *node = JsonNode(); }
+
+  JsonVariant& operator=(bool value) { reset(JsonNode::Bool).boolean = value; return *this; }
+  JsonVariant& operator=(int value) { reset(JsonNode::Int).integer = value; return *this; }
+  JsonVariant& operator=(unsigned value) { reset(JsonNode::Int).integer = value; return *this; }
+  JsonVariant& operator=(long value) { reset(JsonNode::Int).integer = value; return *this; }
+  JsonVariant& operator=(unsigned long value) { reset(JsonNode::Int).integer = value; return *this; }
+  JsonVariant& operator=(long long value) { reset(JsonNode::Int).integer = value; return *this; }
+  JsonVariant& operator=(short value) { reset(JsonNode::Int).integer = value; return *this; }
+  JsonVariant& operator=(unsigned short value) { reset(JsonNode::Int).integer = value; return *this; }
+  JsonVariant& operator=(signed char value) { reset(JsonNode::Int).integer = value; return *this; }
+  JsonVariant& operator=(unsigned char value) { reset(JsonNode::Int).integer = value; return *this; }
+  JsonVariant& operator=(float value) { reset(JsonNode::Float).real = value; return *this; }
+  JsonVariant& operator=(double value) { reset(JsonNode::Float).real = value; return *this; }
+  JsonVariant& operator=(const String& value) { reset(JsonNode::Text).text = value.s; return *this; }
+  JsonVariant& operator=(const char* value) { reset(JsonNode::Text).text = value; return *this; }
+  JsonVariant& operator=(const JsonVariant& value) { *node = *value.node; return *this; }
+
+  template<class T> T as() const;
+  template<class T> bool is() const;
+  template<class T> operator T() const { return as<T>(); }
+
+  std::shared_ptr<JsonNode> node;
+
+ private:
+  std::shared_ptr<JsonNode> child(const std::string& key) {
+    if (node->kind != JsonNode::Object) reset(JsonNode::Object);
+    auto found = node->find(key);
+    if (!found) {
+      found = std::make_shared<JsonNode>();
+      node->members.push_back({key, found});
+    }
+    return found;
+  }
+  JsonNode& reset(JsonNode::Kind kind) { *node = JsonNode(); node->kind = kind; return *node; }
+  double number() const { return node->kind == JsonNode::Float ? node->real : node->kind == JsonNode::Int ? node->integer : node->kind == JsonNode::Bool ? node->boolean : 0; }
+};
+
+typedef JsonVariant JsonObject;
+
+template<class T> inline T JsonVariant::as() const { return (T)number(); }
+template<> inline bool JsonVariant::as<bool>() const { return number() != 0; }
+template<> inline String JsonVariant::as<String>() const { return node->kind == JsonNode::Text ? String(node->text) : String(); }
+template<> inline const char* JsonVariant::as<const char*>() const { return node->kind == JsonNode::Text ? node->text.c_str() : nullptr; }
+template<> inline JsonVariant JsonVariant::as<JsonVariant>() const { return *this; }
+template<class T> inline bool JsonVariant::is() const { return node->kind == JsonNode::Int || node->kind == JsonNode::Float; }
+template<> inline bool JsonVariant::is<bool>() const { return node->kind == JsonNode::Bool; }
+template<> inline bool JsonVariant::is<String>() const { return node->kind == JsonNode::Text; }
+template<> inline bool JsonVariant::is<const char*>() const { return node->kind == JsonNode::Text; }
+template<> inline bool JsonVariant::is<JsonObject>() const { return node->kind == JsonNode::Object; }
+
+class JsonDocument : public JsonVariant {
+ public:
+  template<class T> T to() { clear(); return *this; }
+  size_t memoryUsage() const { return 0; }
+  bool overflowed() const { return false; }
+};
+
+class DynamicJsonDocument : public JsonDocument {
+ public:
+  DynamicJsonDocument(size_t) {}
+  DynamicJsonDocument(const DynamicJsonDocument& other) { node = std::make_shared<JsonNode>(*other.node); }
+};
+
+template<size_t N> class StaticJsonDocument : public JsonDocument {};
+
+class DeserializationError {
+ public:
+  enum Code { Ok, EmptyInput, InvalidInput };
+  DeserializationError(Code code = Ok) : code(code) {}
+  explicit operator bool() const { return code != Ok; }
+  const char* f_str() const { return c_str(); }
+  const char* c_str() const { return code == Ok ? "Ok" : code == EmptyInput ? "EmptyInput" : "InvalidInput"; }
+  Code code;
+};
+
+namespace fake_json {
+
+inline void write(const JsonNode& node, std::string& out) {
+  char number[32];
+  switch (node.kind) {
+    case JsonNode::Null: out += "null"; break;
+    case JsonNode::Bool: out += node.boolean ? "true" : "false"; break;
+    case JsonNode::Int: out += std::to_string(node.integer); break;
+    case JsonNode::Float: snprintf(number, 32, "%.7g", node.real); out += number; break;
+    case JsonNode::Text:
+      out += '"';
+      for (char c : node.text) {
+        if (c == '"' || c == '\\') out += '\\';
+        if (c == '\n') { out += "\\n"; continue; }
+        out += c;
+      }
+      out += '"';
+      break;
+    case JsonNode::Object: {
+      out += '{';
+      bool first = true;
+      for (auto& member : node.members) {
+        if (member.second->kind == JsonNode::Null) continue;
+        if (!first) out += ',';
+        first = false;
+        out += '"' + member.first + "\":";
+        write(*member.second, out);
+      }
+      out += '}';
+      break;
+    }
+  }
+}
+
+class Reader {
+ public:
+  Reader(std::function<int()> next) : next(next) { advance(); }
+
+  DeserializationError::Code value(JsonNode& node) {
+    skip();
+    if (c < 0) return DeserializationError::EmptyInput;
+    if (c == '{') {
+      node.kind = JsonNode::Object;
+      advance();
+      skip();
+      if (c == '}') { advance(); return DeserializationError::Ok; }
+      while (true) {
+        skip();
+        std::string key;
+        if (c != '"' || !text(key)) return DeserializationError::InvalidInput;
+        skip();
+        if (c != ':') return DeserializationError::InvalidInput;
+        advance();
+        auto member = std::make_shared<JsonNode>();
+        if (value(*member) != DeserializationError::Ok) return DeserializationError::InvalidInput;
+        node.members.push_back({key, member});
+        skip();
+        if (c == ',') { advance(); continue; }
+        if (c == '}') { advance(); return DeserializationError::Ok; }
+        return DeserializationError::InvalidInput;
+      }
+    }
+    if (c == '"') {
+      node.kind = JsonNode::Text;
+      return text(node.text) ? DeserializationError::Ok : DeserializationError::InvalidInput;
+    }
+    std::string word;
+    while (c >= 0 && (isalnum(c) || c == '-' || c == '+' || c == '.')) { word += (char)c; advance(); }
+    if (word == "true" || word == "false") { node.kind = JsonNode::Bool; node.boolean = word == "true"; return DeserializationError::Ok; }
+    if (word == "null") return DeserializationError::Ok;
+    if (word.empty()) return DeserializationError::InvalidInput;
+    char* end;
+    if (word.find_first_of(".eE") == std::string::npos) {
+      node.kind = JsonNode::Int;
+      node.integer = strtoll(word.c_str(), &end, 10);
+    } else {
+      node.kind = JsonNode::Float;
+      node.real = strtod(word.c_str(), &end);
+    }
+    return *end == 0 ? DeserializationError::Ok : DeserializationError::InvalidInput;
+  }
+
+ private:
+  std::function<int()> next;
+  int c;
+
+  void advance() { c = next(); }
+  void skip() { while (c == ' ' || c == '\t' || c == '\r' || c == '\n') advance(); }
+  bool text(std::string& out) {
+    advance();
+    while (c >= 0 && c != '"') {
+      if (c == '\\') { advance(); if (c == 'n') c = '\n'; }
+      out += (char)c;
+      advance();
+    }
+    if (c != '"') return false;
+    advance();
+    return true;
+  }
+};
+
+inline DeserializationError parse(JsonDocument& document, std::function<int()> next) {
+  document.clear();
+  JsonNode node;
+  auto code = Reader(next).value(node);
+  *document.node = node;
+  return DeserializationError(code);
+}
+
+}
+
+// Like ArduinoJson 6, appends to the String and returns the number of characters written.
+inline size_t serializeJson(const JsonVariant& document, String& output) { size_t start = output.length(); fake_json::write(*document.node, output.s); return output.length() - start; }
+inline size_t serializeJson(const JsonVariant& document, Print& output) { String text; serializeJson(document, text); return output.print(text); }
+inline size_t measureJson(const JsonVariant& document) { String text; return serializeJson(document, text); }
+
+inline DeserializationError deserializeJson(JsonDocument& document, const char* input, size_t length) {
+  size_t i = 0;
+  return fake_json::parse(document, [&]() { return i < length && input[i] ? (uint8_t)input[i++] : -1; });
+}
+inline DeserializationError deserializeJson(JsonDocument& document, const char* input) { return deserializeJson(document, input, strlen(input)); }
+inline DeserializationError deserializeJson(JsonDocument& document, char* input) { return deserializeJson(document, input, strlen(input)); }
+inline DeserializationError deserializeJson(JsonDocument& document, const String& input) { return deserializeJson(document, input.c_str(), input.length()); }
+
+// Reads a single value from a stream. At most one character after it is consumed.
+inline DeserializationError deserializeJson(JsonDocument& document, Stream& input) {
+  return fake_json::parse(document, [&]() { return input.read(); });
+}
@@ -0,0 +1,5 @@
+#pragma once
+#include <functional>
+typedef int ota_error_t; enum {OTA_AUTH_ERROR,OTA_BEGIN_ERROR,OTA_CONNECT_ERROR,OTA_RECEIVE_ERROR,OTA_END_ERROR};
+struct ArduinoOTAClass { void setHostname(const char*){} void onEnd(std::function<void()>){} void onStart(std::function<void()>){} void onError(std::function<void(ota_error_t)>){} void begin(){} void handle(){} };
+inline ArduinoOTAClass ArduinoOTA;
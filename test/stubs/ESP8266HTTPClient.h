@@ -0,0 +1,45 @@
+#pragma once
+// Blocking HTTP over the stand-in peers: a call costs the peer latency, or the timeout when unreachable.
+#include <ESP8266WiFi.h>
+
+enum { HTTP_CODE_OK = 200, HTTPC_ERROR_CONNECTION_FAILED = -1, HTTPC_ERROR_CONNECTION_LOST = -5, HTTPC_ERROR_READ_TIMEOUT = -11 };
+#define HTTPCLIENT_DEFAULT_TCP_TIMEOUT (5000)
+
+class HTTPClient {
+ public:
+  bool begin(WiFiClient&, const String& url) {
+    int host = url.indexOf("//") + 2;
+    int path = url.indexOf('/', host);
+    peer = url.substring(host, path).s;
+    int port = peer.find(':');
+    if (port > -1) peer.resize(port);
+    this->path = url.substring(path).s;
+    return true;
+  }
+  void addHeader(const String&, const String&) {}
+  int PUT(const String& data) { return send("PUT", data); }
+  int POST(const String& data) { return send("POST", data); }
+  int getSize() { return body.size(); }
+  String getString() { return String(body); }
+  void end() {}
+  void setTimeout(uint16_t ms) { timeout = ms; }
+
+ private:
+  std::string peer;
+  std::string path;
+  std::string body;
+  uint16_t timeout = HTTPCLIENT_DEFAULT_TCP_TIMEOUT;
+
+  int send(const char* method, const String& data) {
+    body.clear();
+    if (!fake_peers.count(peer) || !fake_peers[peer].reachable) {
+      fake_millis += timeout;
+      return HTTPC_ERROR_CONNECTION_FAILED;
+    }
+    FakePeer& reply = fake_peers[peer];
+    fake_millis += reply.latency;
+    reply.requests.push_back(std::string(method) + " " + path + " HTTP/1.1\r\n\r\n" + data.s);
+    body = reply.body;
+    return reply.code;
+  }
+};
@@ -0,0 +1,38 @@
+#pragma once
+// Web server stand-in. Tests set fake_args and read back what the handler sent.
+#include <ESP8266WiFi.h>
+#include <map>
+
+enum HTTPMethod { HTTP_ANY, HTTP_GET, HTTP_POST, HTTP_PUT, HTTP_DELETE };
+#define CONTENT_LENGTH_UNKNOWN ((size_t) -1)
+
+class ESP8266WebServer {
+ public:
+  ESP8266WebServer(int) {}
+  void on(const String& uri, HTTPMethod, std::function<void()> handler) { handlers[uri.s] = handler; }
+  void begin() {}
+  void handleClient() {}
+  bool hasArg(const String& name) { return args.count(name.s) > 0; }
+  String arg(const String& name) { return hasArg(name) ? String(args[name.s]) : String(); }
+  void send(int code, const char*, const String& content) { this->code = code; body += content.s; }
+  void send(int code) { this->code = code; }
+  void setContentLength(size_t) {}
+  void sendContent(const String& content) { body += content.s; }
+  void sendContent(const char* content, size_t length) { body.append(content, length); }
+  void sendHeader(const String& name, const String& value, bool = false) { headers[name.s] = value.s; }
+
+  // Runs a registered route the way a client request would.
+  void request(const String& uri, std::map<std::string, std::string> args = {}) {
+    this->args = args;
+    body.clear();
+    headers.clear();
+    code = 0;
+    handlers[uri.s]();
+  }
+
+  std::map<std::string, std::function<void()>> handlers;
+  std::map<std::string, std::string> args;
+  std::map<std::string, std::string> headers;
+  std::string body;
+  int code = 0;
+};
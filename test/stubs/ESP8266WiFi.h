@@ -0,0 +1,107 @@
+#pragma once
+// WiFi and TCP stand-ins. WiFiClient talks to the stand-in peers in fake_peers.
+#include <Arduino.h>
+#include <WiFiUdp.h>
+#include <map>
+#include <vector>
+
+enum { WL_CONNECTED = 3, WL_DISCONNECTED = 6 };
+enum { WIFI_STA = 1 };
+enum WiFiSleepType { WIFI_NONE_SLEEP, WIFI_LIGHT_SLEEP, WIFI_MODEM_SLEEP };
+
+inline std::string fake_local_ip = "192.168.1.10";
+inline std::string fake_mac = "AA:BB:CC:DD:EE:01";
+inline int fake_wifi_status = WL_CONNECTED;
+
+inline String fakeLocalIP() { return String(fake_local_ip); }
+
+struct FakePeer {
+  bool reachable = true;
+  unsigned long latency = 5; // Milliseconds between the request and the reply.
+  int code = 200;
+  std::string body = "";
+  std::vector<std::string> requests; // Every request received, headers included.
+};
+
+inline std::map<std::string, FakePeer> fake_peers;
+
+class WiFiClass {
+ public:
+  int status() { return fake_wifi_status; }
+  void mode(int) {}
+  void begin(const char*, const char*) {}
+  void begin() {}
+  String SSID() { return "idom"; }
+  String psk() { return ""; }
+  IPAddress localIP() { IPAddress ip; ip.fromString(fake_local_ip.c_str()); return ip; }
+  IPAddress subnetMask() { return IPAddress(255, 255, 255, 0); }
+  bool beginWPSConfig() { return true; }
+  void setAutoReconnect(bool) {}
+  String macAddress() { return String(fake_mac); }
+  void hostname(const char*) {}
+  bool setSleepMode(int) { return true; }
+};
+
+inline WiFiClass WiFi;
+
+class ClientContext;
+
+class WiFiClient : public Stream {
+ public:
+  WiFiClient() {}
+  // A reachable peer accepts at once. An unreachable one holds the caller for the whole timeout.
+  int connect(const IPAddress& ip, uint16_t) {
+    stop();
+    if (!fake_peers.count(ip.toString().s) || !fake_peers[ip.toString().s].reachable) {
+      fake_millis += timeout;
+      return 0;
+    }
+    peer = ip.toString().s;
+    open = true;
+    return 1;
+  }
+  int connect(const String& host, uint16_t port) { IPAddress ip; ip.fromString(host); return connect(ip, port); }
+  uint8_t connected() { return open && (!answered() || position < response.size()); }
+  void setTimeout(unsigned long ms) { timeout = ms; }
+  void setNoDelay(bool) {}
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t* b, size_t n) override {
+    if (!open) return 0;
+    if (request.empty()) sent_millis = millis();
+    request.append((const char*)b, n);
+    return n;
+  }
+  using Print::write;
+  int available() override { return open && answered() ? response.size() - position : 0; }
+  int read() override { return available() > 0 ? (uint8_t)response[position++] : -1; }
+  int read(uint8_t* b, size_t n) { n = std::min<size_t>(n, available()); memcpy(b, response.data() + position, n); position += n; return n; }
+  void stop() {
+    if (open && !request.empty()) fake_peers[peer].requests.push_back(request);
+    open = false;
+    request.clear();
+    response.clear();
+    position = 0;
+  }
+  explicit operator bool() { return open; }
+
+ protected:
+  WiFiClient(ClientContext* context);
+
+ private:
+  std::string peer;
+  std::string request;
+  std::string response;
+  size_t position = 0;
+  unsigned long sent_millis = 0;
+  unsigned long timeout = 5000;
+  bool open = false;
+
+  bool answered() {
+    if (request.empty() || millis() - sent_millis < fake_peers[peer].latency) return false;
+    if (response.empty()) {
+      FakePeer& reply = fake_peers[peer];
+      response = "HTTP/1.1 " + std::to_string(reply.code) + " OK\r\nContent-Length: " + std::to_string(reply.body.size()) + "\r\n\r\n" + reply.body;
+    }
+    return true;
+  }
+};
@@ -0,0 +1,41 @@
+#pragma once
+// LEAmDNS stand-in. Tests announce peers through fake_mdns_callback and fake_mdns_hosts.
+#include <ESP8266WiFi.h>
+#include <vector>
+
+class MDNSResponder {
+ public:
+  enum class AnswerType { Unknown, ServiceDomain, HostDomainAndPort, Txt, IP4Address, IP6Address };
+  typedef const void* hMDNSServiceQuery;
+
+  class MDNSServiceInfo {
+   public:
+    MDNSServiceInfo(const char* service, std::vector<IPAddress> ips) : service(service), ips(ips) {}
+    const char* serviceDomain() { return service.c_str(); }
+    bool IP4AddressAvailable() { return !ips.empty(); }
+    std::vector<IPAddress> IP4Adresses() { return ips; }
+
+   private:
+    std::string service;
+    std::vector<IPAddress> ips;
+  };
+
+  typedef std::function<void(MDNSServiceInfo, AnswerType, bool)> MDNSServiceQueryCallbackFunc;
+
+  bool begin(const char*) { return true; }
+  void update() {}
+  bool addService(const char*, const char*, uint16_t) { return true; }
+  hMDNSServiceQuery installServiceQuery(const char*, const char*, MDNSServiceQueryCallbackFunc callback) {
+    callbacks.push_back(callback);
+    return &callbacks.back();
+  }
+  bool removeServiceQuery(hMDNSServiceQuery) { callbacks.clear(); return true; }
+  uint32_t queryService(const char*, const char*) { queries++; return hosts.size(); }
+  IPAddress IP(uint32_t index) { IPAddress ip; ip.fromString(hosts[index].c_str()); return ip; }
+
+  std::vector<MDNSServiceQueryCallbackFunc> callbacks; // Installed passive queries.
+  std::vector<std::string> hosts; // Answers to the blocking queryService().
+  int queries = 0;
+};
+
+inline MDNSResponder MDNS;
@@ -0,0 +1,112 @@
+#pragma once
+// In-memory LittleFS. Every handle to a path shares the same contents.
+#include <Arduino.h>
+#include <map>
+#include <memory>
+
+enum SeekMode { SeekSet = 0, SeekCur = 1, SeekEnd = 2 };
+
+inline std::map<std::string, std::shared_ptr<std::string>> fake_files;
+inline size_t fake_fs_total = 1 << 20;
+
+class File : public Stream {
+ public:
+  File() {}
+  File(const std::string& path, std::shared_ptr<std::string> data, size_t position) : path(path), data(data), position_(position) {}
+  explicit operator bool() const { return data != nullptr; }
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t* b, size_t n) override {
+    if (!data) return 0;
+    if (data->size() < position_ + n) data->resize(position_ + n);
+    memcpy(&(*data)[position_], b, n);
+    position_ += n;
+    return n;
+  }
+  using Print::write;
+  int available() override { return data ? data->size() - position_ : 0; }
+  int read() override { return available() > 0 ? (uint8_t)(*data)[position_++] : -1; }
+  int peek() override { return available() > 0 ? (uint8_t)(*data)[position_] : -1; }
+  int read(uint8_t* b, size_t n) { n = std::min<size_t>(n, available()); if (n) memcpy(b, data->data() + position_, n); position_ += n; return n; }
+  bool seek(uint32_t offset, SeekMode mode = SeekSet) {
+    size_t target = mode == SeekSet ? offset : mode == SeekCur ? position_ + offset : size() + offset;
+    if (!data || target > size()) return false;
+    position_ = target;
+    return true;
+  }
+  size_t position() const { return position_; }
+  size_t size() const { return data ? data->size() : 0; }
+  void close() { data = nullptr; }
+  const char* name() const { return path.c_str() + 1; }
+  const char* fullName() const { return path.c_str(); }
+  bool truncate(uint32_t size) { if (!data) return false; data->resize(size); return true; }
+  bool isFile() const { return true; }
+  time_t getLastWrite() { return 0; }
+
+ private:
+  std::string path;
+  std::shared_ptr<std::string> data;
+  size_t position_ = 0;
+};
+
+class Dir {
+ public:
+  Dir() {}
+  Dir(std::string prefix) : prefix(prefix) {}
+  bool next() {
+    auto i = started ? fake_files.upper_bound(current) : fake_files.lower_bound(prefix);
+    started = true;
+    if (i == fake_files.end() || i->first.compare(0, prefix.size(), prefix) != 0) return false;
+    current = i->first;
+    return true;
+  }
+  String fileName() { return String(current.substr(prefix.size())); }
+  size_t fileSize() { return fake_files.count(current) ? fake_files[current]->size() : 0; }
+  File openFile(const char*) { return File(current, fake_files[current], 0); }
+  bool rewind() { started = false; return true; }
+
+ private:
+  std::string prefix;
+  std::string current;
+  bool started = false;
+};
+
+struct FSInfo {
+  size_t totalBytes;
+  size_t usedBytes;
+  size_t blockSize;
+  size_t pageSize;
+  size_t maxOpenFiles;
+  size_t maxPathLength;
+};
+
+class FS {
+ public:
+  bool begin() { return true; }
+  File open(const String& path, const char* mode) {
+    std::string name = path.s;
+    if (mode[0] == 'r') {
+      if (!fake_files.count(name)) return File();
+      return File(name, fake_files[name], 0);
+    }
+    if (mode[0] == 'w' || !fake_files.count(name)) fake_files[name] = std::make_shared<std::string>();
+    return File(name, fake_files[name], mode[0] == 'a' ? fake_files[name]->size() : 0);
+  }
+  bool exists(const String& path) { return fake_files.count(path.s) > 0; }
+  bool remove(const String& path) { return fake_files.erase(path.s) > 0; }
+  bool rename(const String& from, const String& to) {
+    if (!fake_files.count(from.s)) return false;
+    fake_files[to.s] = fake_files[from.s];
+    fake_files.erase(from.s);
+    return true;
+  }
+  Dir openDir(const String& path) { return Dir(path.endsWith("/") ? path.s : path.s + "/"); }
+  bool info(FSInfo& info) {
+    info = {};
+    info.totalBytes = fake_fs_total;
+    for (auto& file : fake_files) info.usedBytes += file.second->size();
+    return true;
+  }
+  bool mkdir(const String&) { return true; }
+};
+
+inline FS LittleFS;
@@ -0,0 +1,2 @@
+#pragma once
+class OneWire { public: OneWire(int){} };
@@ -0,0 +1,54 @@
+#pragma once
+#include <Arduino.h>
+#include <ctime>
+
+class DateTime {
+ public:
+  DateTime(uint32_t t = 0) : t(t) {}
+  DateTime(uint16_t y, uint8_t m, uint8_t d, uint8_t h = 0, uint8_t mm = 0, uint8_t s = 0) {
+    struct tm parts = {};
+    parts.tm_year = y - 1900;
+    parts.tm_mon = m - 1;
+    parts.tm_mday = d;
+    parts.tm_hour = h;
+    parts.tm_min = mm;
+    parts.tm_sec = s;
+    t = timegm(&parts);
+  }
+  uint32_t unixtime() const { return t; }
+  uint16_t year() const { return parts().tm_year + 1900; }
+  uint8_t month() const { return parts().tm_mon + 1; }
+  uint8_t day() const { return parts().tm_mday; }
+  uint8_t hour() const { return parts().tm_hour; }
+  uint8_t minute() const { return parts().tm_min; }
+  uint8_t second() const { return parts().tm_sec; }
+  uint8_t dayOfTheWeek() const { return parts().tm_wday; }
+
+ private:
+  uint32_t t;
+  struct tm parts() const { time_t x = t; struct tm r; gmtime_r(&x, &r); return r; }
+};
+
+inline uint32_t fake_rtc_time = 0; // Unix time set by adjust(), counted forward with millis().
+inline unsigned long fake_rtc_millis = 0;
+inline bool fake_rtc_running = false;
+inline uint8_t fake_rtc_nvram[56];
+
+class RTC_DS1307 {
+ public:
+  bool begin() { return true; }
+  bool isrunning() { return fake_rtc_running; }
+  DateTime now() { return DateTime(fake_rtc_time + (millis() - fake_rtc_millis) / 1000); }
+  void adjust(const DateTime& time) { fake_rtc_time = time.unixtime(); fake_rtc_millis = millis(); fake_rtc_running = true; }
+  uint8_t readnvram(uint8_t address) { return fake_rtc_nvram[address]; }
+  void writenvram(uint8_t address, uint8_t data) { fake_rtc_nvram[address] = data; }
+  void readnvram(uint8_t* buffer, uint8_t size, uint8_t address) { memcpy(buffer, fake_rtc_nvram + address, size); }
+  void writenvram(uint8_t address, const uint8_t* buffer, uint8_t size) { memcpy(fake_rtc_nvram + address, buffer, size); }
+};
+
+class RTC_Millis {
+ public:
+  void begin(const DateTime& time) { adjust(time); }
+  DateTime now() { return DateTime(fake_rtc_time + (millis() - fake_rtc_millis) / 1000); }
+  void adjust(const DateTime& time) { fake_rtc_time = time.unixtime(); fake_rtc_millis = millis(); }
+};
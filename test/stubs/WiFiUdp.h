@@ -0,0 +1,64 @@
+#pragma once
+// Multicast UDP loopback: sent datagrams and test-injected ones share one queue.
+#include <Arduino.h>
+#include <deque>
+
+class IPAddress {
+ public:
+  IPAddress() {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : bytes{a, b, c, d} {}
+  uint8_t operator[](int i) const { return bytes[i]; }
+  String toString() const { char b[16]; snprintf(b, 16, "%u.%u.%u.%u", bytes[0], bytes[1], bytes[2], bytes[3]); return String(b); }
+  bool fromString(const String& text) {
+    unsigned a, b, c, d;
+    if (sscanf(text.c_str(), "%u.%u.%u.%u", &a, &b, &c, &d) != 4) return false;
+    *this = IPAddress(a, b, c, d);
+    return true;
+  }
+  bool isSet() const { return bytes[0] | bytes[1] | bytes[2] | bytes[3]; }
+  bool operator==(const IPAddress& x) const { return memcmp(bytes, x.bytes, 4) == 0; }
+  operator const IPAddress*() const { return this; } // Stands in for the conversion to const ip_addr_t*.
+
+ private:
+  uint8_t bytes[4] = {0, 0, 0, 0};
+};
+
+struct FakeDatagram {
+  std::string from;
+  std::string data;
+};
+
+inline std::deque<FakeDatagram> fake_datagrams;
+inline int fake_datagrams_sent = 0;
+String fakeLocalIP();
+
+class WiFiUDP : public Stream {
+ public:
+  uint8_t begin(uint16_t) { return 1; }
+  uint8_t beginMulticast(IPAddress, IPAddress, uint16_t) { return 1; }
+  int beginPacket(IPAddress, uint16_t) { outgoing.clear(); return 1; }
+  int beginPacketMulticast(IPAddress, uint16_t, IPAddress, int ttl = 1) { outgoing.clear(); return 1; }
+  int endPacket() { fake_datagrams.push_back({fakeLocalIP().s, outgoing}); fake_datagrams_sent++; return 1; }
+  size_t write(uint8_t c) override { outgoing += (char)c; return 1; }
+  size_t write(const uint8_t* b, size_t n) override { outgoing.append((const char*)b, n); return n; }
+  using Print::write;
+  int parsePacket() {
+    if (fake_datagrams.empty()) return 0;
+    incoming = fake_datagrams.front();
+    fake_datagrams.pop_front();
+    position = 0;
+    return incoming.data.size();
+  }
+  int available() override { return incoming.data.size() - position; }
+  int read() override { return available() > 0 ? (uint8_t)incoming.data[position++] : -1; }
+  int read(char* b, size_t n) { n = std::min<size_t>(n, available()); memcpy(b, incoming.data.data() + position, n); position += n; return n; }
+  int read(uint8_t* b, size_t n) { return read((char*)b, n); }
+  IPAddress remoteIP() { IPAddress ip; ip.fromString(incoming.from.c_str()); return ip; }
+  uint16_t remotePort() { return 8081; }
+  void stop() {}
+
+ private:
+  std::string outgoing;
+  FakeDatagram incoming;
+  size_t position = 0;
+};
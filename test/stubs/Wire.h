@@ -0,0 +1,2 @@
+#pragma once
+struct TwoWire{void begin(){} void beginTransmission(int){} int endTransmission(){return 0;} int requestFrom(int,int){return 0;} int read(){return 0;} void write(int){}}; inline TwoWire Wire;
@@ -0,0 +1,4 @@
+#pragma once
+#include <Arduino.h>
+typedef void(*switchCallback_t)(void*);
+class Switch { public: Switch(int){} bool poll(){return false;} void setSingleClickCallback(switchCallback_t,void*){} void setLongPressCallback(switchCallback_t,void*){} };
@@ -0,0 +1,38 @@
+#pragma once
+// Raw lwIP TCP stand-in. A connect to a reachable peer in fake_peers is established at once, any other stays in SYN_SENT.
+#include <ESP8266WiFi.h>
+
+typedef int8_t err_t;
+enum { ERR_OK = 0, ERR_MEM = -1, ERR_ABRT = -13 };
+enum tcp_state { CLOSED = 0, SYN_SENT = 2, ESTABLISHED = 4 };
+typedef IPAddress ip_addr_t;
+
+struct tcp_pcb;
+typedef void (*tcp_err_fn)(void* arg, err_t err);
+typedef err_t (*tcp_connected_fn)(void* arg, tcp_pcb* pcb, err_t err);
+
+struct tcp_pcb {
+  tcp_state state = CLOSED;
+  std::string peer;
+  void* callback_arg = nullptr;
+  tcp_err_fn errf = nullptr;
+};
+
+inline int fake_pcbs = 0; // Allocated and not yet freed or adopted.
+
+inline tcp_pcb* tcp_new() { fake_pcbs++; return new tcp_pcb; }
+inline void tcp_arg(tcp_pcb* pcb, void* arg) { pcb->callback_arg = arg; }
+inline void tcp_err(tcp_pcb* pcb, tcp_err_fn errf) { pcb->errf = errf; }
+inline err_t tcp_connect(tcp_pcb* pcb, const ip_addr_t* ip, uint16_t, tcp_connected_fn) {
+  pcb->peer = ip->toString().s;
+  pcb->state = fake_peers.count(pcb->peer) && fake_peers[pcb->peer].reachable ? ESTABLISHED : SYN_SENT;
+  return ERR_OK;
+}
+// Like lwIP, frees the pcb and then reports ERR_ABRT through the error callback.
+inline void tcp_abort(tcp_pcb* pcb) {
+  tcp_err_fn errf = pcb->errf;
+  void* arg = pcb->callback_arg;
+  delete pcb;
+  fake_pcbs--;
+  if (errf) errf(arg, ERR_ABRT);
+}
@@ -0,0 +1,2 @@
+#pragma once
+class SunSet { public: void setPosition(double,double,double){} void setCurrentDate(int,int,int){} double calcSunset(){return 0;} double calcSunrise(){return 0;} };
@@ -0,0 +1,33 @@
+#pragma once
+// Host tests build the device sources against the stand-ins in test/stubs.
+#include "../src/main.cpp"
+#include <chrono>
+
+inline int test_failures = 0;
+
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) { \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+      test_failures++; \
+    } \
+  } while (0)
+
+#define CHECK_EQUAL(actual, expected) \
+  do { \
+    String actual_text = String(actual); \
+    String expected_text = String(expected); \
+    if (actual_text != expected_text) { \
+      printf("%s:%d: %s is \"%s\", expected \"%s\"\n", __FILE__, __LINE__, #actual, actual_text.c_str(), expected_text.c_str()); \
+      test_failures++; \
+    } \
+  } while (0)
+
+inline double elapsedMicroseconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+inline int finishTest(const char* name) {
+  printf("%s: %s\n", name, test_failures == 0 ? "passed" : "FAILED");
+  return test_failures == 0 ? 0 : 1;
+}
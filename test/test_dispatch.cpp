@@ -0,0 +1,100 @@
+#include "test.h"
+
+bool transfersIdle() {
+  for (int i = 0; i < max_transfers; i++) {
+    if (transfers_array[i].busy) {
+      return false;
+    }
+  }
+  return dispatch_count == 0;
+}
+
+// Runs the loop's share of the transfers until they are done, returns the longest single call.
+unsigned long drain() {
+  unsigned long longest = 0;
+  for (int i = 0; i < 1000 && !transfersIdle(); i++) {
+    unsigned long start = millis();
+    dispatchOfflineData();
+    longest = max(longest, millis() - start);
+    delay(idle_slice);
+  }
+  return longest;
+}
+
+int main() {
+  fake_millis = 1000;
+  fake_peers["192.168.1.20"].latency = 30;
+  fake_peers["192.168.1.21"].reachable = false;
+  fake_peers["192.168.1.22"].latency = 100;
+  registerDevice("192.168.1.20", "");
+  registerDevice("192.168.1.21", "");
+  registerDevice("192.168.1.22", "");
+
+  // A silent peer does not hold the loop, its connect is given up after transfer_connect_timeout.
+  putMultiOfflineData("{\"temp\":21.50}");
+  CHECK(dispatch_count == 3);
+  unsigned long start = millis();
+  unsigned long longest = drain();
+  CHECK(longest <= 2);
+  CHECK(millis() - start > transfer_connect_timeout);
+  CHECK(fake_pcbs == 0);
+  CHECK(transfersIdle());
+  CHECK(fake_peers["192.168.1.20"].requests.size() == 1);
+  CHECK(fake_peers["192.168.1.20"].requests[0].find("PUT /set HTTP/1.1\r\n") == 0);
+  CHECK(fake_peers["192.168.1.20"].requests[0].find("\r\n\r\n{\"temp\":21.50}") != std::string::npos);
+  CHECK(fake_peers["192.168.1.22"].requests.size() == 1);
+  CHECK(devices_array[findDevice("192.168.1.20")].failed_millis == 0);
+  CHECK(devices_array[findDevice("192.168.1.21")].failed_millis > 0);
+  printf("  longest loop call with a silent peer: %lu ms\n", longest);
+
+  // The silent peer is left alone until device_backoff passes.
+  putMultiOfflineData("{\"temp\":21.60}");
+  CHECK(dispatch_count == 2);
+  drain();
+  delay(device_backoff);
+  putMultiOfflineData("{\"temp\":21.70}");
+  CHECK(dispatch_count == 3);
+  drain();
+
+  // Requests to different peers are in flight at the same time.
+  fake_peers["192.168.1.21"].reachable = true;
+  fake_peers["192.168.1.21"].latency = 100;
+  fake_peers["192.168.1.20"].latency = 100;
+  start = millis();
+  putMultiOfflineData("{\"temp\":21.80}");
+  drain();
+  CHECK(millis() - start < 300);
+
+  // A peer that accepts but never answers is given up after transfer_timeout.
+  fake_peers["192.168.1.22"].latency = 60000;
+  putOfflineData("192.168.1.22", "{\"val\":\"1\"}");
+  start = millis();
+  drain();
+  CHECK(millis() - start >= transfer_timeout);
+  CHECK(millis() - start < transfer_timeout + 100);
+  CHECK(devices_array[findDevice("192.168.1.22")].failed_millis > 0);
+  fake_peers["192.168.1.22"].latency = 100;
+
+  // The /basicdata replies are read as they arrive.
+  fake_peers["192.168.1.20"].body = "{\"ip\":\"192.168.1.20\",\"id\":\"AA:BB:CC:DD:EE:20\",\"offset\":7200}";
+  getOfflineData();
+  CHECK(dispatch_count == 3);
+  drain();
+  CHECK(fake_peers["192.168.1.20"].requests.back().find("POST /basicdata HTTP/1.1\r\n") == 0);
+  CHECK(offset == 7200);
+  CHECK_EQUAL(devices_array[findDevice("192.168.1.20")].mac, "AA:BB:CC:DD:EE:20");
+
+  // A full queue drops the oldest entry and counts it.
+  for (int i = 0; i < max_dispatches + 2; i++) {
+    putOfflineData("192.168.1.20", "{\"val\":\"" + String(i) + "\"}");
+  }
+  CHECK(dispatch_drops == 2);
+  CHECK_EQUAL(dispatch_array[dispatch_first].data, "{\"val\":\"2\"}");
+  server.args = {};
+  server.body.clear();
+  handshake();
+  CHECK(server.body.find("\"dropped_transfers\":2") != std::string::npos);
+  drain();
+
+  return finishTest("dispatch");
+}
@@ -0,0 +1,120 @@
+#include "test.h"
+
+String requestLog(const char* from) {
+  server.args = {{"from", from}};
+  server.body.clear();
+  server.headers.clear();
+  requestForLogs();
+  return String(server.body);
+}
+
+int lines(const String& text, const String& needle) {
+  int count = 0;
+  for (int i = text.indexOf(needle); i >= 0; i = text.indexOf(needle, i + 1)) {
+    count++;
+  }
+  return count;
+}
+
+int main() {
+  rtc.adjust(DateTime(2024, 3, 1, 12, 0, 0));
+  keep_log = true;
+
+  // A message from flash longer than the copy on the stack is logged whole.
+  static const char long_text[] = "Flash message "
+    "0123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789"
+    "0123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789 end";
+  note(F(long_text), log_info);
+  flushLog(true);
+  CHECK(requestLog("").indexOf(long_text) >= 0);
+
+  // Entries wait in the buffer until the flush delay passes or the buffer fills.
+  size_t size = fake_files["/log0.bin"]->size();
+  note("Buffered", log_info);
+  flushLog(false);
+  CHECK(fake_files["/log0.bin"]->size() == size);
+  delay(log_flush_delay);
+  flushLog(false);
+  CHECK(fake_files["/log0.bin"]->size() > size);
+  CHECK(log_buffer_length == 0);
+  while (log_buffer_length < log_flush_threshold - 64) {
+    note("Filling the buffer", log_info);
+  }
+  note("Filling the buffer", log_info);
+  note("Filling the buffer", log_info);
+  CHECK(log_buffer_length < log_flush_threshold);
+
+  // Segments rotate and only the newest log_segments are kept.
+  for (int i = 0; i < 2000; i++) {
+    note("Entry " + String(i), log_info);
+  }
+  flushLog(true);
+  CHECK(log_segment >= log_segments);
+  CHECK(!LittleFS.exists(getLogSegment(log_segment - log_segments)));
+  CHECK(oldestLogSegment() == log_segment - log_segments + 1);
+  for (int i = oldestLogSegment(); i < log_segment; i++) {
+    CHECK(fake_files[getLogSegment(i).s]->size() >= (size_t)log_segment_size);
+  }
+
+  // Log-Offset is the segment in the high half and the position in it in the low half.
+  String all = requestLog("");
+  uint32_t end = strtoul(server.headers["Log-Offset"].c_str(), 0, 10);
+  CHECK(end == ((uint32_t)log_segment << 16) + fake_files[getLogSegment(log_segment).s]->size());
+  CHECK(all.startsWith("Log file\n"));
+  CHECK(all.indexOf("Entry 1999\r\n") >= 0);
+  CHECK(all.indexOf(long_text) < 0);
+
+  // Reading from the offset returns only what was logged after it.
+  note("After the offset", log_info);
+  String tail = requestLog(String(end).c_str());
+  CHECK_EQUAL(tail, "[1.3.24 12:0:10] After the offset\r\n");
+
+  // An offset inside an older segment starts there, one before the oldest starts at the oldest.
+  int oldest = oldestLogSegment();
+  String from_segment = requestLog(String((uint32_t)(oldest + 1) << 16).c_str());
+  CHECK(lines(from_segment, "\r\n") < lines(all, "\r\n"));
+  CHECK(from_segment.endsWith("After the offset\r\n"));
+  String from_removed = requestLog(String((uint32_t)(oldest - 1) << 16).c_str());
+  CHECK(lines(from_removed, "\r\n") == lines(all, "\r\n") + 1);
+
+  // /log/tail takes UTC and compares it with the local time of the entries.
+  offset = 3600;
+  dst = true;
+  delay(5000);
+  note("Local noon", log_info);
+  server.args = {{"since", String((uint32_t)DateTime(2024, 3, 1, 10, 0, 12).unixtime()).c_str()}};
+  server.body.clear();
+  requestForLogTail();
+  CHECK_EQUAL(String(server.body), "[1.3.24 12:0:15] Local noon\r\n");
+
+  // Right after a rotation the new segment is empty but the log is still served.
+  int segment = log_segment;
+  while (log_segment == segment) {
+    note("Until the rotation", log_info);
+    flushLog(true);
+  }
+  CHECK(log_buffer_length == 0);
+  requestLog("");
+  CHECK(server.code == 200);
+  CHECK(strtoul(server.headers["Log-Offset"].c_str(), 0, 10) == (uint32_t)log_segment << 16);
+  CHECK(String(server.body).indexOf("Until the rotation") >= 0);
+  server.headers.clear();
+  requestForLogTail();
+  CHECK(server.code == 200);
+
+  // The cost of a note(), buffer flushes and segment rotations included.
+  const int calls = 20000;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < calls; i++) {
+    note(F("Timed entry"), log_info);
+  }
+  double note_time = elapsedMicroseconds(start) / calls;
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < calls; i++) {
+    note(F("Timed entry"), log_debug);
+  }
+  double filtered_time = elapsedMicroseconds(start) / calls;
+  printf("log, %d notes: %.3f us per call logged, %.3f us below the threshold\n", calls, note_time, filtered_time);
+
+  return finishTest("log");
+}
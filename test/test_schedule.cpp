@@ -0,0 +1,38 @@
+#include "test.h"
+
+String schedule() {
+  String result;
+  for (int i = 0; i < schedule_count; i++) {
+    result += String(i > 0 ? " " : "") + String(schedule_array[i].minute) + (schedule_array[i].heating ? "+" : "-");
+    if (schedule_array[i].temperature != no_setpoint) {
+      result += fixedPointToString(schedule_array[i].temperature);
+    }
+  }
+  return result;
+}
+
+int main() {
+  // Monday 2026-01-12 07:30, minute 1440 + 450 of the week.
+  adjustRTC(DateTime(2026, 1, 12, 7, 30, 0));
+
+  setSmart("to|21.50|h(360;480)");
+  CHECK_EQUAL(schedule(), "1800+21.5 1920-");
+
+  setSmart("ta|1|h(1320;360)");
+  CHECK_EQUAL(schedule(), "360- 9960+");
+
+  setSmart("ts|1|h(1320;360)");
+  CHECK_EQUAL(schedule(), "1320+ 1800-");
+
+  setSmart("tr|1|h(600;-1),tr|0|1200_");
+  CHECK_EQUAL(schedule(), "7800+ 8400-");
+
+  setSmart("tsouehra|1|360_,tsouehra|0|1320_,tsouehra|19.00|r(1)420_");
+  CHECK(schedule_count == 14);
+
+  setSmart("to|21.50|h(360;480),te|0|600_,to|1|&t(20.0)h(360;480)");
+  requestForSchedule();
+  CHECK_EQUAL(String(server.body), "{\"now\":1890,\"schedule\":[{\"start\":1800,\"end\":1920,\"heating\":true,\"temp\":21.50,\"smart\":0},{\"start\":1920,\"end\":11880,\"heating\":false,\"smart\":0}]}");
+
+  return finishTest("schedule");
+}
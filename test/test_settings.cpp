@@ -0,0 +1,95 @@
+#include "test.h"
+
+int main() {
+  String long_location = "52.23371720000000x21.07143220000000";
+
+  // /set refuses a location that would not fit the settings record.
+  settings_dirty = false;
+  readData("{\"location\":\"" + long_location + "\"}", true);
+  CHECK_EQUAL(geo_location, default_location);
+  CHECK(!settings_dirty);
+  readData("{\"location\":\"50.06x19.94\"}", true);
+  CHECK_EQUAL(geo_location, "50.06x19.94");
+  CHECK(settings_dirty);
+
+  // An old settings file with values the record cannot hold keeps the current ones.
+  ssid = "home";
+  password = "secret";
+  LittleFS.open("/settings.txt", "w").print("{\"ssid\":\"" + String(std::string(33, 's')) + "\",\"password\":\""
+    + String(std::string(65, 'p')) + "\",\"location\":\"" + long_location + "\",\"offset\":3600}");
+  CHECK(readSettings(false));
+  CHECK_EQUAL(ssid, "home");
+  CHECK_EQUAL(password, "secret");
+  CHECK_EQUAL(geo_location, "50.06x19.94");
+  CHECK(offset == 3600);
+
+  // Values that fit survive a round trip through /settings.bin.
+  ssid = String(std::string(32, 's'));
+  password = String(std::string(64, 'p'));
+  geo_location = String(std::string(33, 'l'));
+  writeSettings(false);
+  ssid = password = geo_location = "";
+  CHECK(readSettings(false));
+  CHECK_EQUAL(ssid, String(std::string(32, 's')));
+  CHECK_EQUAL(password, String(std::string(64, 'p')));
+  CHECK_EQUAL(geo_location, String(std::string(33, 'l')));
+
+  // The boot-time save of the uprisings count is written without waiting for settings_delay.
+  int32_t boots = uprisings;
+  CHECK(readSettings(false));
+  CHECK(!settings_dirty);
+  CHECK(uprisings == boots + 1);
+  uprisings = 0;
+  CHECK(readSettings(false));
+  CHECK(uprisings == boots + 2);
+
+  // Each save keeps the previous copy, and a read takes the newest copy that checks out.
+  offset = 3600;
+  writeSettings(false);
+  offset = 7200;
+  writeSettings(false);
+  CHECK(LittleFS.exists("/settings.bin.bak"));
+  CHECK(!LittleFS.exists("/settings.bin.tmp"));
+  std::string older = *fake_files["/settings.bin.bak"];
+  std::string newer = *fake_files["/settings.bin"];
+
+  (*fake_files["/settings.bin"])[newer.size() - 1] ^= 1;
+  CHECK(readSettings(false));
+  CHECK(offset == 3600);
+
+  // A reset between writing the new copy and renaming it.
+  *fake_files["/settings.bin"] = older;
+  fake_files["/settings.bin.tmp"] = std::make_shared<std::string>(newer);
+  LittleFS.remove("/settings.bin.bak");
+  CHECK(readSettings(false));
+  CHECK(offset == 7200);
+
+  // A reset while the new copy was still being written.
+  *fake_files["/settings.bin"] = older;
+  fake_files["/settings.bin.tmp"] = std::make_shared<std::string>(newer.substr(0, newer.size() / 2));
+  CHECK(readSettings(false));
+  CHECK(offset == 3600);
+  CHECK(!LittleFS.exists("/settings.bin.tmp"));
+
+  // POST /admin/log?level= changes only the threshold, and the threshold is saved with the settings.
+  keep_log = false;
+  server.args = {{"level", "4"}};
+  activationTheLog();
+  CHECK(log_threshold == log_debug);
+  CHECK(!keep_log);
+  flushSettings(true);
+  log_threshold = log_info;
+  CHECK(readSettings(false));
+  CHECK(log_threshold == log_debug);
+
+  // A schema 1 record, which ends before log_threshold, is still read.
+  SettingsRecord record = {};
+  record.schema = 1;
+  record.offset = 1800;
+  writeCheckedFile("/settings.bin", (const uint8_t*)&record, settings_v1_size);
+  CHECK(readSettings(false));
+  CHECK(offset == 1800);
+  CHECK(log_threshold == log_info);
+
+  return finishTest("settings");
+}
@@ -0,0 +1,192 @@
+#include "test.h"
+
+// Live heap bytes, counted by replacing the global allocator. Host strings keep up to 15 characters inline, the ESP8266 core 11.
+size_t heap_live = 0;
+
+void* operator new(size_t size) {
+  size_t* block = (size_t*)malloc(size + 16);
+  *block = size;
+  heap_live += size;
+  return (char*)block + 16;
+}
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* pointer) noexcept {
+  if (pointer != nullptr) {
+    size_t* block = (size_t*)((char*)pointer - 16);
+    heap_live -= *block;
+    free(block);
+  }
+}
+void operator delete[](void* pointer) noexcept { operator delete(pointer); }
+void operator delete(void* pointer, size_t) noexcept { operator delete(pointer); }
+void operator delete[](void* pointer, size_t) noexcept { operator delete(pointer); }
+
+// The rule record and the per-rule work of smartAction() before the packed layout, thermostat build.
+struct LegacySmart {
+  String smart_string;
+  bool enabled;
+  String days;
+  bool any_trigger_required;
+  String action;
+  int at_time;
+  int start_time;
+  int end_time;
+  bool at_sunset;
+  int sunset_offset;
+  bool has_lowering_at_sunset_offset;
+  bool at_sunrise;
+  int sunrise_offset;
+  int at_dusk;
+  int local_dusk_time;
+  int dusk_offset;
+  int dusk_day;
+  int at_dawn;
+  int local_dawn_time;
+  int dawn_offset;
+  int dawn_day;
+  String at_thermostat;
+  int thermostat_offset;
+  int thermostat_offset_countdown;
+  String must_be_;
+  String twilight_must_be_;
+  uint32_t lead_u_time;
+};
+
+LegacySmart* legacy_array;
+int legacy_count = 0;
+
+void setLegacySmart(int count) {
+  legacy_array = new LegacySmart[count];
+  legacy_count = count;
+  for (int i = 0; i < count; i++) {
+    LegacySmart& rule = legacy_array[i];
+    rule = LegacySmart();
+    rule.enabled = true;
+    rule.days = "souehra";
+    rule.any_trigger_required = true;
+    rule.at_time = rule.start_time = rule.end_time = rule.at_dusk = rule.at_dawn = -1;
+    rule.local_dusk_time = rule.local_dawn_time = rule.dusk_day = rule.dawn_day = -1;
+    rule.thermostat_offset_countdown = -1;
+    rule.twilight_must_be_ = "?";
+    if (i % 2 == 0) {
+      rule.smart_string = "tsouehra|1|" + String((i * 7) % 1440 + 1) + "_r(<30.0)";
+      rule.action = "1";
+      rule.at_time = (i * 7) % 1440 + 1;
+      rule.at_thermostat = "?";
+      rule.must_be_ = "<30.0";
+    } else {
+      rule.smart_string = "tsouehra|21.5|t(>25.0)";
+      rule.action = "21.5";
+      rule.at_thermostat = "25.0";
+      rule.must_be_ = "?";
+    }
+  }
+}
+
+int legacySmartAction(int trigger, DateTime now) {
+  int current_time = now.hour() * 60 + now.minute();
+  int fired = 0;
+  String action;
+  String local_log;
+  for (int i = 0; i < legacy_count; i++) {
+    LegacySmart& rule = legacy_array[i];
+    if (!rule.enabled || !strContains(rule.days, days_of_the_week[now.dayOfTheWeek()])) {
+      continue;
+    }
+    bool local_result = false;
+    bool some_activation = false;
+    bool at_time_result = false;
+    bool at_thermostat_result = false;
+    action = "?";
+    local_log = "";
+
+    if (rule.at_time > -1) {
+      at_time_result = rule.at_time == current_time && rule.lead_u_time + 60 < now.unixtime();
+      some_activation |= at_time_result;
+      local_result |= at_time_result;
+    }
+    if (rule.at_thermostat != "?") {
+      at_thermostat_result = trigger == 6 || rule.thermostat_offset_countdown == 0;
+      at_thermostat_result &= temperature == rule.at_thermostat.toFloat();
+      some_activation |= at_thermostat_result;
+      if (rule.thermostat_offset_countdown > -1) {
+        rule.thermostat_offset_countdown--;
+      }
+      local_result |= at_thermostat_result;
+    }
+    if (rule.must_be_ != "?") {
+      if (strContains(rule.must_be_, ".")) {
+        if (strContains(rule.must_be_, "<") || strContains(rule.must_be_, ">")) {
+          if (strContains(rule.must_be_, "<")) {
+            local_result &= temperature < rule.must_be_.substring(1).toFloat();
+          } else {
+            local_result &= temperature > rule.must_be_.substring(1).toFloat();
+          }
+        } else {
+          local_result &= temperature == rule.must_be_.toFloat();
+        }
+      } else {
+        local_result &= heating == strContains(rule.must_be_, "1");
+      }
+    }
+    if (rule.twilight_must_be_ != "?") {
+      if (strContains(rule.twilight_must_be_, "<")) {
+        local_result &= sensor_twilight;
+      }
+    }
+    local_result &= some_activation;
+    local_result &= (rule.at_time == -1 || at_time_result) && (rule.at_thermostat == "?" || at_thermostat_result);
+    fired += local_result;
+  }
+  return fired;
+}
+
+String makeRules(int count) {
+  String rules;
+  for (int i = 0; i < count; i++) {
+    rules += i > 0 ? "," : "";
+    rules += i % 2 == 0 ? "tsouehra|1|" + String((i * 7) % 1440 + 1) + "_r(<30.0)" : String("tsouehra|21.5|t(>25.0)");
+  }
+  return rules;
+}
+
+int main() {
+  rtc.adjust(DateTime(2024, 3, 4, 0, 0, 0)); // Minute 0, where none of the rules is due.
+  temperature = 20.0;
+
+  printf("  Smart is %zu bytes, the String-based record was %zu\n", sizeof(Smart), sizeof(LegacySmart));
+  const int counts[] = {10, 30, 100};
+  for (int count : counts) {
+    String rules = makeRules(count);
+    size_t before = heap_live;
+    setSmart(rules);
+    size_t packed_heap = heap_live - before;
+    CHECK(smart_count == count);
+
+    before = heap_live;
+    setLegacySmart(count);
+    size_t legacy_heap = heap_live - before;
+
+    const int ticks = 2000;
+    auto start = std::chrono::steady_clock::now();
+    for (int tick = 0; tick < ticks; tick++) {
+      smartAction(-1, false);
+    }
+    double packed_time = elapsedMicroseconds(start) / ticks;
+    int fired = 0;
+    start = std::chrono::steady_clock::now();
+    for (int tick = 0; tick < ticks; tick++) {
+      fired += legacySmartAction(-1, rtc.now());
+    }
+    double legacy_time = elapsedMicroseconds(start) / ticks;
+    CHECK(fired == 0);
+    CHECK(!heating);
+
+    printf("smart footprint, %d rules: %zu heap bytes packed, %zu String-based; %.3f us per evaluation packed, %.3f us String-based\n",
+      count, packed_heap, legacy_heap, packed_time, legacy_time);
+    delete [] legacy_array;
+    setSmart("");
+  }
+
+  return finishTest("smart footprint");
+}
@@ -0,0 +1,84 @@
+#include "test.h"
+
+// Rules that may act in the given minute, found by scanning every rule.
+std::vector<int> scanDueSmart(int minute) {
+  std::vector<int> due;
+  for (int i = 0; i < smart_count; i++) {
+    if (smart_array[i].enabled && (isEventSmart(i) || smart_array[i].at_time == minute
+    || (smart_array[i].at_sunset && verifiedTime(next_sunset + smart_array[i].sunset_offset) == minute)
+    || (smart_array[i].at_sunrise && verifiedTime(next_sunrise + smart_array[i].sunrise_offset) == minute))) {
+      due.push_back(i);
+    }
+  }
+  return due;
+}
+
+std::vector<int> indexDueSmart(int minute) {
+  std::vector<int> due;
+  int event = 0;
+  int trigger = findSmartTrigger(minute);
+  int i;
+  while ((i = nextDueSmart(event, trigger, minute)) > -1) {
+    due.push_back(i);
+  }
+  return due;
+}
+
+String makeRules(int count, int event_every) {
+  String rules;
+  for (int i = 0; i < count; i++) {
+    if (i > 0) {
+      rules += ",";
+    }
+    if (i % event_every == event_every - 1) {
+      rules += "tsouehra|1|h(" + String(i % 1440) + ";" + String((i + 30) % 1440) + ")";
+    } else if (i % 17 == 0) {
+      rules += "tsouehra|0|n(" + String(i % 60 - 30) + ")";
+    } else if (i % 19 == 0) {
+      rules += "t/souehra|1|" + String((i * 7) % 1440) + "_";
+    } else {
+      rules += "tsouehra|1|" + String((i * 7) % 1440) + "_";
+    }
+  }
+  return rules;
+}
+
+int main() {
+  next_sunset = 1200;
+  next_sunrise = 400;
+
+  setSmart(makeRules(200, 10));
+  CHECK(smart_count == 200);
+  for (int minute = 0; minute < 1440; minute++) {
+    if (indexDueSmart(minute) != scanDueSmart(minute)) {
+      printf("minute %d: index and scan disagree\n", minute);
+      test_failures++;
+    }
+  }
+
+  setSmart("tsouehra|1|n(-10)d(20)480_,tsouehra|0|n");
+  CHECK(indexDueSmart(1190) == std::vector<int>({0}));
+  CHECK(indexDueSmart(420) == std::vector<int>({0}));
+  CHECK(indexDueSmart(480) == std::vector<int>({0}));
+  CHECK(indexDueSmart(1200) == std::vector<int>({1}));
+  CHECK(indexDueSmart(481).empty());
+
+  const int counts[] = {10, 100, 1000}; // 1000 rules do not fit the ESP8266 heap, the figure shows how the index scales.
+  for (int count : counts) {
+    setSmart(makeRules(count, 1000));
+    size_t visited = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int minute = 0; minute < 1440; minute++) {
+      visited += indexDueSmart(minute).size();
+    }
+    double index_time = elapsedMicroseconds(start) / 1440;
+    start = std::chrono::steady_clock::now();
+    for (int minute = 0; minute < 1440; minute++) {
+      visited += scanDueSmart(minute).size();
+    }
+    double scan_time = elapsedMicroseconds(start) / 1440;
+    printf("smart index, %d rules: %.3f us per minute indexed, %.3f us scanned (%zu due)\n", count, index_time, scan_time, visited / 2);
+  }
+
+  return finishTest("smart index");
+}
@@ -0,0 +1,99 @@
+#include "test.h"
+
+struct ParserCase {
+  const char* rule;
+  int error; // Expected error position, -1 when the rule is valid.
+};
+
+const ParserCase parser_cases[] = {
+  {"tsouehra|1|480_", -1},
+  {"t/ouehr|0|n(-15)d(30)", -1},
+  {"tsa&h(300;420)r(>20.5)", -1},
+  {"tsouehra|21.50|t(>21.5;5)r2(n)", -1},
+  {"tsouehra|1|480_e(1700000000)", -1},
+  {"tsouehrax|1|480_", 8},
+  {"tsouehra|1|480", 14},
+  {"tsouehra|1|h(300)", 16},
+  {"tsouehra|1|n(", 12},
+  {"tsouehra|1|r2(q)", 14},
+  {"tsouehra|1|t(400)", 13},
+  {"tsouehra|1|t(327.68)", 13},
+  {"tsouehra|1|99999999999_", 11},
+  {"tsouehra|1|n(-99999)", 13},
+  {"tsouehra|1|e(99999999999)", 13},
+};
+
+String makeRules(int count) {
+  String rules;
+  for (int i = 0; i < count; i++) {
+    if (i > 0) {
+      rules += ",";
+    }
+    rules += i % 3 == 0 ? "tsouehra|1|" + String(i % 1440) + "_e(1700000000)" : (i % 3 == 1 ? "touehr|21.50|t(>21.5;5)r(<19.00)" : "tsa&h(300;420)n(-15)r2(n)");
+  }
+  return rules;
+}
+
+int main() {
+  for (const ParserCase& parser_case : parser_cases) {
+    setSmart(parser_case.rule);
+    CHECK(smart_count == 1);
+    if (smart_array[0].syntax_error != parser_case.error) {
+      printf("%s: error at %d, expected %d\n", parser_case.rule, smart_array[0].syntax_error, parser_case.error);
+      test_failures++;
+    }
+    if (parser_case.error > -1) {
+      CHECK(!smart_array[0].enabled);
+    }
+    CHECK_EQUAL(getSmartString(true), parser_case.rule);
+  }
+
+  setSmart("tsouehra|1|480_");
+  CHECK(smart_array[0].at_time == 480);
+  CHECK(smart_array[0].action_value == 1);
+  setSmart("tsouehra|21.50|t(<-5.25)");
+  CHECK(smart_array[0].at_thermostat == -525);
+  CHECK(smart_array[0].thermostat_direction == -1);
+  CHECK(smart_array[0].action_value == 2150);
+  setSmart("tsouehra|1|n(-15)d(30)h(300;-1)");
+  CHECK(smart_array[0].sunset_offset == -15);
+  CHECK(smart_array[0].sunrise_offset == 30);
+  CHECK(smart_array[0].start_time == 300);
+  CHECK(smart_array[0].end_time == -1);
+
+  setSmart("tsouehra|1|480_r(>21.5),tsouehra|1|480_r(<19.25),tsouehra|1|480_r(20.0),tsouehra|1|480_r(1),tsouehra|1|480_r2(n<)");
+  CHECK_EQUAL(getSmartMustBe(0), ">21.5");
+  CHECK_EQUAL(getSmartMustBe(1), "<19.25");
+  CHECK_EQUAL(getSmartMustBe(2), "20.0");
+  CHECK_EQUAL(getSmartMustBe(3), "1");
+  CHECK_EQUAL(getSmartMustBe(4), "?");
+  CHECK_EQUAL(getSmartTwilightMustBe(4), "n<");
+
+  String rules = "tsouehra|1|480_,tsouehra|1|t(400),tsouehra|0|1320_";
+  setSmart(rules);
+  CHECK(smart_count == 3);
+  CHECK(smart_array[0].enabled && !smart_array[1].enabled && smart_array[2].enabled);
+  CHECK(smart_array[2].at_time == 1320);
+  CHECK_EQUAL(getSmartString(true), rules);
+  settings_dirty = false;
+  readData("{\"smart\":\"" + rules + "\"}", true);
+  CHECK(!settings_dirty);
+
+  const int counts[] = {16, 64, 256};
+  for (int count : counts) {
+    String benchmark_rules = makeRules(count);
+    int passes = 20000 / count;
+    setSmart(benchmark_rules);
+    CHECK(smart_count == count);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < passes; i++) {
+      for (int j = 0; j < smart_count; j++) {
+        parseSmart(j);
+      }
+    }
+    double elapsed = elapsedMicroseconds(start);
+    printf("smart parser, %d rules: %.0f rules/s\n", count, passes * count / elapsed * 1e6);
+  }
+
+  return finishTest("smart parser");
+}
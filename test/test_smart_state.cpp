@@ -0,0 +1,156 @@
+#include "test.h"
+
+std::string& file(const char* path) {
+  static std::string none;
+  return fake_files.count(path) ? *fake_files[path] : none;
+}
+
+// The restore before the journal: one {"0":{"smart":...},"count":n} object, each rule matched against every entry by text.
+void legacyReadSmart() {
+  File file = LittleFS.open("/legacy.txt", "r");
+  DynamicJsonDocument json_object(smart_count * 400);
+  deserializeJson(json_object, file);
+  file.close();
+
+  int count = json_object["count"].as<int>();
+  JsonObject json_object_2;
+  for (int i = 0; i < smart_count; i++) {
+    for (int j = 0; j < count; j++) {
+      json_object_2 = json_object[String(j)].as<JsonObject>();
+      if (smart_array[i].smart_string == json_object_2["smart"].as<String>()) {
+        restoreSmart(i, json_object_2);
+      }
+    }
+  }
+}
+
+// ...and the save before the journal: every change rewrote the whole file.
+void legacyWriteSmart() {
+  DynamicJsonDocument json_object(smart_detail_size);
+  String content = "{";
+  int count = 0;
+  for (int i = 0; i < smart_count; i++) {
+    if (getSmartJson(i, true, json_object)) {
+      content += "\"" + String(count++) + "\":";
+      serializeJson(json_object, content);
+      content += ",";
+    }
+  }
+  content += "\"count\":" + String(count) + "}";
+  LittleFS.open("/legacy.txt", "w").print(content);
+}
+
+void benchmarkBoot(int count) {
+  String rules;
+  for (int i = 0; i < count; i++) {
+    rules += String(i > 0 ? "," : "") + "tsouehra|1|" + String(i * 7 % 1440) + "_";
+  }
+  LittleFS.remove("/smart.txt");
+  LittleFS.remove("/smart.txt.bak");
+  LittleFS.remove("/journal.txt");
+  setSmart(rules);
+  for (int i = 0; i < smart_count; i++) {
+    smart_array[i].lead_u_time = 1700000000 + i;
+  }
+  compactSmartJournal();
+  legacyWriteSmart();
+  for (int i = 0; i < 10; i++) {
+    smart_array[i * count / 10].thermostat_offset_countdown = 60;
+    smart_array[i * count / 10].state_changed = true;
+  }
+  journalSmart();
+  std::string smart_file = file("/smart.txt");
+  std::string journal = file("/journal.txt");
+
+  const int rounds = 20;
+  auto start = std::chrono::steady_clock::now();
+  for (int round = 0; round < rounds; round++) {
+    fake_files["/smart.txt"] = std::make_shared<std::string>(smart_file);
+    fake_files["/journal.txt"] = std::make_shared<std::string>(journal);
+    readSmart();
+  }
+  double journal_time = elapsedMicroseconds(start) / rounds;
+  CHECK(smart_array[count - 1].lead_u_time == 1700000000u + count - 1);
+  CHECK(smart_array[count / 10].thermostat_offset_countdown == 60);
+
+  start = std::chrono::steady_clock::now();
+  for (int round = 0; round < rounds; round++) {
+    smart_array[count - 1].lead_u_time = 0;
+    legacyReadSmart();
+    legacyWriteSmart();
+  }
+  double legacy_time = elapsedMicroseconds(start) / rounds;
+  CHECK(smart_array[count - 1].lead_u_time == 1700000000u + count - 1);
+
+  for (int i = 0; i < smart_count; i++) {
+    smart_array[i].state_changed = false;
+  }
+  LittleFS.remove("/journal.txt");
+  start = std::chrono::steady_clock::now();
+  for (int round = 0; round < rounds; round++) {
+    smart_array[round].state_changed = true;
+    journalSmart();
+  }
+  double change_time = elapsedMicroseconds(start) / rounds;
+  CHECK(LittleFS.exists("/journal.txt"));
+  start = std::chrono::steady_clock::now();
+  for (int round = 0; round < rounds; round++) {
+    legacyWriteSmart();
+  }
+  double rewrite_time = elapsedMicroseconds(start) / rounds;
+
+  printf("smart state, %d rules: boot %.0f us with journal replay and compaction, %.0f us with the old restore and rewrite;"
+    " one change %.0f us journaled, %.0f us rewritten\n", count, journal_time, legacy_time, change_time, rewrite_time);
+  setSmart("");
+  LittleFS.remove("/legacy.txt");
+}
+
+int main() {
+  const char* rules = "tsouehra|1|480_e(1700000000),tsouehra|21.50|t(>21.5;5),tsouehra|0|1320_";
+
+  // A /smart.txt written before rule hashes: one object keyed by position, matched by rule text.
+  LittleFS.open("/smart.txt", "w").print("{\"0\":{\"smart\":\"tsouehra|1|480_e(1699990000)\",\"lead_time\":1699990000},"
+    "\"1\":{\"smart\":\"tsouehra|21.50|t(>21.5;5)\",\"thermostat_offset_countdown\":120},"
+    "\"2\":{\"smart\":\"tsouehra|1|999_\",\"lead_time\":5},\"count\":3}");
+  setSmart(rules);
+  CHECK(smart_array[0].lead_u_time == 1699990000);
+  CHECK(smart_array[1].thermostat_offset_countdown == 120);
+  CHECK(smart_array[2].lead_u_time == 0);
+  CHECK(file("/smart.txt").rfind("#", 0) == 0);
+  CHECK(file("/smart.txt").find("\n{\"hash\":") != std::string::npos);
+  CHECK(!LittleFS.exists("/journal.txt"));
+
+  // The migrated file is read back in the current format, and the journal replays on top of it.
+  smart_array[1].thermostat_offset_countdown = 60;
+  smart_array[1].state_changed = true;
+  journalSmart();
+  setSmart("");
+  setSmart(rules);
+  CHECK(smart_array[0].lead_u_time == 1699990000);
+  CHECK(smart_array[1].thermostat_offset_countdown == 60);
+  CHECK(!LittleFS.exists("/journal.txt"));
+
+  // A compaction cut short by a reset leaves the last /smart.txt and the journal in place.
+  smart_array[1].thermostat_offset_countdown = 30;
+  smart_array[1].state_changed = true;
+  journalSmart();
+  std::string journal = file("/journal.txt");
+  compactSmartJournal();
+  fake_files["/smart.txt.tmp"] = std::make_shared<std::string>(file("/smart.txt").substr(0, 40));
+  fake_files["/smart.txt"] = fake_files["/smart.txt.bak"];
+  fake_files["/journal.txt"] = std::make_shared<std::string>(journal);
+  setSmart("");
+  setSmart(rules);
+  CHECK(smart_array[0].lead_u_time == 1699990000);
+  CHECK(smart_array[1].thermostat_offset_countdown == 30);
+
+  // A damaged old file is left alone.
+  LittleFS.remove("/smart.txt.bak");
+  LittleFS.open("/smart.txt", "w").print("{\"0\":{\"smart\":");
+  setSmart(rules);
+  CHECK(smart_array[0].lead_u_time == 1700000000);
+
+  benchmarkBoot(200);
+
+  return finishTest("smart state");
+}
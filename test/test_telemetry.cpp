@@ -0,0 +1,74 @@
+#include "test.h"
+
+void datagram(const char* from, const String& data) {
+  fake_datagrams.push_back({from, data.s});
+  receiveTelemetry();
+}
+
+int main() {
+  fake_millis = 1000;
+  offset = 3600;
+  fake_peers["192.168.1.20"].body = "{\"ip\":\"192.168.1.20\",\"id\":\"AA:BB:CC:DD:EE:20\",\"offset\":3600,\"multicast\":true}";
+  fake_peers["192.168.1.21"].body = "{\"ip\":\"192.168.1.21\",\"id\":\"AA:BB:CC:DD:EE:21\",\"offset\":3600}";
+  registerDevice("192.168.1.20", "");
+  registerDevice("192.168.1.21", "");
+
+  // Only a peer that says it listens is left to the multicast.
+  getOfflineData();
+  while (dispatch_count > 0 || transfers_array[0].busy || transfers_array[1].busy) {
+    dispatchOfflineData();
+    delay(idle_slice);
+  }
+  CHECK(devices_array[findDevice("192.168.1.20")].multicast);
+  CHECK(!devices_array[findDevice("192.168.1.21")].multicast);
+  putMultiOfflineData("{\"temp\":21.50}");
+  CHECK(fake_datagrams_sent == 1);
+  CHECK(dispatch_count == 1);
+  CHECK_EQUAL(dispatch_array[dispatch_first].ip, "192.168.1.21");
+
+  // Our own datagram comes back through the loopback and is ignored.
+  CHECK(fake_datagrams.size() == 1);
+  CHECK(fake_datagrams.front().data.find("{\"seq\":1,\"ip\":\"192.168.1.10\",\"id\":\"AA:BB:CC:DD:EE:01\",\"temp\":21.50}") == 0);
+  receiveTelemetry();
+  CHECK(fake_datagrams.empty());
+  CHECK(devices_count == 2);
+
+  // A stranger is not registered and cannot change settings.
+  datagram("192.168.1.99", "{\"seq\":1,\"ip\":\"192.168.1.99\",\"id\":\"AA:BB:CC:DD:EE:99\",\"offset\":7200}");
+  CHECK(findDevice("192.168.1.99") < 0);
+  CHECK(offset == 3600);
+
+  // A registered peer whose mac has not come in through /basicdata yet cannot vouch for itself.
+  registerDevice("192.168.1.22", "");
+  datagram("192.168.1.22", "{\"seq\":1,\"ip\":\"192.168.1.22\",\"id\":\"AA:BB:CC:DD:EE:22\",\"temp\":19.00}");
+  CHECK(devices_array[findDevice("192.168.1.22")].multicast_seq == 0);
+  CHECK(devices_array[findDevice("192.168.1.22")].mac.length() == 0);
+
+  // A known peer gets through, but only with its temperature.
+  datagram("192.168.1.21", "{\"seq\":1,\"ip\":\"192.168.1.21\",\"id\":\"AA:BB:CC:DD:EE:21\",\"temp\":20.00,\"offset\":7200,\"smart\":\"\"}");
+  CHECK(offset == 3600);
+  CHECK(devices_array[findDevice("192.168.1.21")].multicast_seq == 1);
+  CHECK(!devices_array[findDevice("192.168.1.21")].multicast);
+
+  // Datagrams that do not match their sender or are not JSON are dropped.
+  datagram("192.168.1.21", "{\"seq\":5,\"ip\":\"192.168.1.20\",\"id\":\"AA:BB:CC:DD:EE:21\"}");
+  datagram("192.168.1.21", "{\"seq\":5,\"ip\":\"192.168.1.21\",\"id\":\"AA:BB:CC:DD:EE:20\"}");
+  datagram("192.168.1.21", "{\"seq\":5,\"ip\":\"192.168.1.21\",\"id\":\"AA:BB:CC:DD:EE:21\"");
+  datagram("192.168.1.21", "{\"seq\":\"5\",\"ip\":\"192.168.1.21\",\"id\":\"AA:BB:CC:DD:EE:21\"}");
+  CHECK(devices_array[findDevice("192.168.1.21")].multicast_seq == 1);
+  CHECK(telemetry_lost == 0);
+
+  // Gaps in the sequence are counted, a restart is not.
+  datagram("192.168.1.21", "{\"seq\":4,\"ip\":\"192.168.1.21\",\"id\":\"AA:BB:CC:DD:EE:21\",\"temp\":20.10}");
+  CHECK(telemetry_lost == 2);
+  datagram("192.168.1.21", "{\"seq\":1,\"ip\":\"192.168.1.21\",\"id\":\"AA:BB:CC:DD:EE:21\",\"temp\":20.20}");
+  CHECK(telemetry_lost == 2);
+
+  // Our /basicdata reply says we listen.
+  server.args = {};
+  server.body.clear();
+  exchangeOfBasicData();
+  CHECK(server.body.find("\"multicast\":true") != std::string::npos);
+
+  return finishTest("telemetry");
+}
@@ -0,0 +1,35 @@
+#include "test.h"
+
+// Feeds the samples to a single t() rule and returns which of them fired it.
+String fireTrace(const String& rule, std::vector<float> samples) {
+  setSmart(rule);
+  String fired;
+  for (float sample : samples) {
+    heating = false;
+    smart_heating = -1;
+    temperature = sample;
+    smartAction(6, false);
+    fired += heating ? "x" : ".";
+  }
+  return fired;
+}
+
+int main() {
+  adjustRTC(DateTime(2026, 1, 14, 12, 0, 0));
+  hysteresis = 0.25;
+
+  // The first sample only arms the rule. A rise fires above 21.75, a fall below 21.25.
+  CHECK_EQUAL(fireTrace("tsouehra|1|t(21.5)", {21.0, 21.4, 21.6, 21.8, 21.9, 21.6, 21.3, 21.2, 21.0, 21.4, 21.8}), "...x...x..x");
+  // Rise, then fall: 21.6 arms the falling edge and 21.0 fires it.
+  CHECK_EQUAL(fireTrace("tsouehra|1|t(21.5)", {21.0, 21.6, 21.0}), "..x");
+  CHECK_EQUAL(fireTrace("tsouehra|1|t(21.5)", {21.0, 21.8, 21.0}), ".xx");
+  CHECK_EQUAL(fireTrace("tsouehra|1|t(>21.5)", {21.0, 21.8, 21.0, 21.8}), ".x.x");
+  CHECK_EQUAL(fireTrace("tsouehra|1|t(<21.5)", {21.0, 21.8, 21.0, 21.8}), "..x.");
+  // Noise around the threshold does not fire within the band.
+  CHECK_EQUAL(fireTrace("tsouehra|1|t(21.5)", {21.0, 21.55, 21.45, 21.6, 21.4, 21.7, 21.3}), ".......");
+
+  hysteresis = 0.0;
+  CHECK_EQUAL(fireTrace("tsouehra|1|t(21.5)", {21.0, 21.5, 21.6, 21.4}), ".x.x");
+
+  return finishTest("thermostat trigger");
+}
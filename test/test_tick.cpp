@@ -0,0 +1,74 @@
+#include "test.h"
+
+// Runs loop() for the given simulated time. stall_at, counted in seconds after each minute
+// boundary, marks where a blocking call holds the loop for stall_ms.
+int runLoop(uint32_t seconds, int stall_at, uint32_t stall_ms) {
+  int passes = 0;
+  uint32_t end_millis = fake_millis + seconds * 1000;
+  uint32_t stalled_minute = 0;
+  while (fake_millis < end_millis) {
+    uint32_t u_time = rtc.now().unixtime();
+    if (stall_ms > 0 && u_time % 60 == (uint32_t)stall_at && u_time / 60 != stalled_minute) {
+      stalled_minute = u_time / 60;
+      fake_millis += stall_ms;
+    }
+    loop();
+    passes++;
+  }
+  return passes;
+}
+
+int main() {
+  fake_temperature = 22.0;
+  correction = 0.0;
+  adjustRTC(DateTime(2026, 1, 14, 0, 40, 30));
+  loop();
+
+  // No stall: one sample per minute, at :00.
+  int samples = fake_temperature_requests;
+  uint32_t i2c = i2c_transactions;
+  int passes = runLoop(600, -1, 0);
+  CHECK(fake_temperature_requests - samples == 10);
+  printf("tick, idle: %.0f loop passes and %.1f RTC reads per minute\n", passes / 10.0, (i2c_transactions - i2c) / 10.0);
+
+  // A 2.5 s stall just before every minute boundary makes each tick land after :00.
+  samples = fake_temperature_requests;
+  int ntp_updates = fake_ntp_updates;
+  runLoop(600, 59, 2500);
+  CHECK(fake_temperature_requests - samples == 10);
+  CHECK(fake_ntp_updates - ntp_updates == 1);
+
+  // The sunset refresh runs once on the first tick of a minute after 3:01.
+  geo_location = "52.2;21.0";
+  last_sun_check = 0;
+  adjustRTC(DateTime(2026, 1, 15, 3, 5, 58));
+  runLoop(120, 0, 3000);
+  CHECK(last_sun_check == 15);
+
+  // A t() countdown ticks every second, but only on a day the rule runs (15.01.2026 is a Thursday).
+  adjustRTC(DateTime(2026, 1, 15, 12, 0, 10));
+  loop();
+  setSmart("tsouehra|21.5|t(>25.0;5)");
+  smart_array[0].thermostat_offset_countdown = 200;
+  CHECK(secondsToNextTick() == 1);
+  setSmart("tsouera|21.5|t(>25.0;5)");
+  smart_array[0].thermostat_offset_countdown = 200;
+  CHECK(secondsToNextTick() == 60 - (int)(loop_u_time % 60));
+  setSmart("");
+
+  // Between reads RTCnow() counts on with millis(), a read only moves the count when they disagree.
+  adjustRTC(DateTime(2026, 1, 15, 12, 0, 0));
+  delay(300);
+  i2c = i2c_transactions;
+  uint32_t read_u_time = RTCnow().unixtime();
+  delay(5500);
+  CHECK(RTCnow().unixtime() == read_u_time + 5);
+  delay(700);
+  CHECK(RTCnow().unixtime() == read_u_time + 6);
+  CHECK(i2c_transactions - i2c == 2);
+  delay(rtc_refresh);
+  CHECK(RTCnow().unixtime() == read_u_time + 66);
+  CHECK(i2c_transactions - i2c == 4);
+
+  return finishTest("tick");
+}